@@ -0,0 +1,154 @@
+// Minimal stand-ins for the Particle (Spark) firmware API, so messagetorch.ino can be
+// built and exercised on a development host. Included (via -include) into every test
+// program, each of which is a single translation unit together with the generated
+// messagetorch.cpp, so the globals below are defined right here.
+//
+// Time: by default, micros() is a virtual clock which advances by 3uS per call and by the
+// requested time in delay(). Define HOST_REALTIME to use the real clock instead (needed
+// when several threads run, see PLATFORM_THREADING below).
+
+#pragma once
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+typedef uint8_t byte;
+
+
+// Wiring String, just what messagetorch uses
+
+class String {
+  std::string s;
+public:
+  String() {}
+  String(const char *aCStr) : s(aCStr) {}
+  String(char aChar) : s(1, aChar) {}
+  String(int aVal) : s(std::to_string(aVal)) {}
+  String(const std::string &aStr) : s(aStr) {}
+  unsigned int length() const { return s.size(); }
+  char operator[](int aIdx) const { return s[aIdx]; }
+  int indexOf(char aChar, int aFrom=0) const { size_t p = s.find(aChar, aFrom); return p==std::string::npos ? -1 : (int)p; }
+  String substring(int aFrom, int aTo=-1) const {
+    if (aTo<0 || aTo>(int)s.size()) aTo = s.size();
+    if (aFrom>aTo) aFrom = aTo;
+    return String(s.substr(aFrom, aTo-aFrom));
+  }
+  long toInt() const { return atol(s.c_str()); }
+  bool operator==(const char *aCStr) const { return s==aCStr; }
+  bool operator==(const String &aStr) const { return s==aStr.s; }
+  bool operator!=(const String &aStr) const { return s!=aStr.s; }
+  String &operator+=(const String &aStr) { s += aStr.s; return *this; }
+  String &operator+=(char aChar) { s += aChar; return *this; }
+  void toCharArray(char *aBuf, unsigned aSize) const { strncpy(aBuf, s.c_str(), aSize); aBuf[aSize-1] = 0; }
+  const char *c_str() const { return s.c_str(); }
+  bool startsWith(const char *aPrefix) const { return s.compare(0, strlen(aPrefix), aPrefix)==0; }
+};
+
+
+// Time
+
+#ifdef HOST_REALTIME
+#include <unistd.h>
+inline unsigned long micros() { struct timespec t; clock_gettime(CLOCK_MONOTONIC, &t); return (unsigned long)(t.tv_sec*1000000ULL+t.tv_nsec/1000); }
+inline void delay(unsigned long aMs) { usleep(aMs*1000); }
+#else
+unsigned long hostMicros = 0;
+inline unsigned long micros() { return hostMicros += 3; }
+inline void delay(unsigned long aMs) { hostMicros += aMs*1000; }
+#endif
+inline unsigned long millis() { return micros()/1000; }
+
+inline void __disable_irq() {}
+inline void __enable_irq() {}
+inline void __WFI() {}
+
+
+// SPI: all bytes sent are captured in hostSpiBytes
+
+#define SPI_CLOCK_DIV2 0
+#define SPI_CLOCK_DIV4 1
+#define SPI_CLOCK_DIV8 2
+#define SPI_CLOCK_DIV16 3
+#define SPI_CLOCK_DIV32 4
+#define SPI_CLOCK_DIV64 5
+#define SPI_CLOCK_DIV128 6
+#define SPI_CLOCK_DIV256 7
+#define MSBFIRST 1
+#define SPI_MODE0 0
+
+std::vector<uint8_t> hostSpiBytes;
+bool hostSpiCapture = false; // set to record bytes in hostSpiBytes
+
+class SPIClass {
+public:
+  void begin() {}
+  void setClockDivider(int aDivider) {}
+  void setBitOrder(int aOrder) {}
+  void setDataMode(int aMode) {}
+  uint8_t transfer(uint8_t aByte) { if (hostSpiCapture) hostSpiBytes.push_back(aByte); return 0; }
+} SPI;
+
+
+// Cloud: functions and variables are not registered anywhere, tests call the handlers directly
+
+enum { INT=1, DOUBLE=2, STRING=4 };
+#define PRIVATE 0
+
+int hostPublishCount = 0; // number of events published
+std::string hostLastPublish; // name and data of last event published
+
+class SparkClass {
+public:
+  template<class F> bool function(const char *aName, F aFn) { return true; }
+  template<class V> bool variable(const char *aName, V aVar, int aType=0) { return true; }
+  bool publish(const char *aName, const char *aData, int aTtl=60, int aFlags=0) {
+    hostPublishCount++;
+    hostLastPublish = std::string(aName)+" "+aData;
+    return true;
+  }
+  void connect() {}
+  bool connected() { return true; }
+  void process() {}
+} Spark, Particle;
+
+#define SYSTEM_MODE(aMode)
+#define SYSTEM_THREAD(aMode)
+
+class TimeClass {
+public:
+  time_t now() { return 0; }
+} Time;
+
+
+// EEPROM (size as on the Photon)
+
+class EEPROMClass {
+  uint8_t data[2047];
+public:
+  EEPROMClass() { memset(data, 0xFF, sizeof(data)); }
+  size_t length() { return sizeof(data); }
+  uint8_t read(int aAddr) { return data[aAddr]; }
+  void write(int aAddr, uint8_t aVal) { data[aAddr] = aVal; }
+  template<class T> T &get(int aAddr, T &aObj) { memcpy(&aObj, data+aAddr, sizeof(T)); return aObj; }
+  template<class T> const T &put(int aAddr, const T &aObj) { memcpy(data+aAddr, &aObj, sizeof(T)); return aObj; }
+} EEPROM;
+
+
+// Threads (only with PLATFORM_THREADING, as on the Photon)
+
+#if defined(PLATFORM_THREADING) && PLATFORM_THREADING
+#include <thread>
+#define OS_THREAD_PRIORITY_DEFAULT 2
+class Thread {
+public:
+  Thread(const char *aName, void (*aFn)(void *), void *aParam=NULL, int aPriority=OS_THREAD_PRIORITY_DEFAULT, size_t aStackSize=0) {
+    std::thread(aFn, aParam).detach();
+  }
+};
+#endif
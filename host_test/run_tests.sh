@@ -0,0 +1,55 @@
+#!/bin/sh
+# Build messagetorch.ino on the development host against the stubs in particle.h,
+# and run the tests. Needs a C++11 compiler and python3.
+#
+#   host_test/run_tests.sh
+#
+# Like the Particle build, the .ino gets prototypes of all its functions inserted before
+# the first function, so functions can be used before they are defined.
+
+set -e
+cd "$(dirname "$0")"
+mkdir -p build
+
+python3 - <<'PY'
+import re
+src = open("../messagetorch.ino").read()
+protos = []
+first = None
+for m in re.finditer(r'^((?:static )?(?:unsigned |const )?[A-Za-z_][\w:<>]*[ \*&]+)([A-Za-z_]\w*)\(([^;{)]*)\)\s*\n?\{', src, re.M):
+    ret, name, args = m.group(1), m.group(2), m.group(3)
+    if '::' in ret or '::' in name or name in ('if', 'while', 'for', 'switch') or ret.startswith('return'):
+        continue
+    if first is None:
+        first = m.start()
+    args = re.sub(r'\s*=\s*[^,]+', '', args) # no default values in prototypes
+    protos.append("%s%s(%s);" % (ret, name, args))
+out = '#line 1 "messagetorch.ino"\n' + src[:first] + '\n'.join(protos) + '\n#line %d "messagetorch.ino"\n' % (src[:first].count('\n')+1) + src[first:]
+open("build/messagetorch.cpp", "w").write(out)
+PY
+
+CXX=${CXX:-g++}
+CXXFLAGS="-std=gnu++11 -funsigned-char -g -O1 -Wall -Wno-unused-function -Wno-unused-variable -Wno-unused-but-set-variable -Wno-class-memaccess -Ibuild -include particle.h"
+
+failed=0
+# run <name> <source> [extra compiler flags]
+run()
+{
+  name=$1; src=$2; shift 2
+  $CXX $CXXFLAGS "$@" "$src" -o "build/$name" -lpthread
+  if "./build/$name"; then
+    echo "PASS $name"
+  else
+    echo "FAIL $name"
+    failed=1
+  fi
+}
+
+run ws281x_core test_ws281x.cpp -DPLATFORM_ID=0
+run ws281x_photon test_ws281x.cpp -DPLATFORM_ID=6
+run simulation test_simulation.cpp -DPLATFORM_ID=6 -DSELFTEST=1
+run text test_text.cpp -DPLATFORM_ID=6 -DSELFTEST=1
+run render_single test_render_thread.cpp -DPLATFORM_ID=6 -DPLATFORM_THREADING=0 -DHOST_REALTIME -DSELFTEST=1
+run render_thread test_render_thread.cpp -DPLATFORM_ID=6 -DPLATFORM_THREADING=1 -DHOST_REALTIME -DSELFTEST=1 -pthread
+
+exit $failed
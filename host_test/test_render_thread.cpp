@@ -0,0 +1,75 @@
+// Checks that a stalled application loop (like a hanging cloud connection) does not freeze
+// the animation when rendering runs in its own thread, by stalling loop() for 1.5 seconds
+// (SELFTEST "stall" param) and looking at the longest gap between frames reported in "stats".
+// Built with and without PLATFORM_THREADING: single threaded, the gap must show the stall
+// (proving the test can see it), with the render thread, it must stay short.
+// With the render thread, loop() must also not spin (it would take CPU time from rendering).
+// Also checks that state changes still get published as vdsd_state events from loop().
+
+#include "messagetorch.cpp"
+
+#include <unistd.h>
+
+const uint32_t stallMs = 1500; // must match the stall param below
+const uint32_t maxThreadedGapMs = 200;
+
+
+uint32_t loopCalls = 0; // number of loop() calls in runLoop()
+
+// run the application loop for aMs, return the largest gap_ms published in stats meanwhile
+uint32_t runLoop(uint32_t aMs)
+{
+  uint32_t maxGap = 0;
+  uint32_t start = millis();
+  while (millis()-start<aMs) {
+    loop();
+    loopCalls++;
+    const char *g = strstr(statsText, "gap_ms=");
+    if (g) {
+      uint32_t gap = atoi(g+7);
+      if (gap>maxGap) maxGap = gap;
+    }
+  }
+  return maxGap;
+}
+
+
+int main()
+{
+  setup();
+  cloudParams("mode=1"); // torch, never a static display
+  runLoop(2500); // settle
+  loopCalls = 0;
+  uint32_t gapBefore = runLoop(1500);
+  uint32_t loopsBefore = loopCalls;
+  // posted like a cloud function call, the stall itself happens in loop()
+  if (cloudParams("stall=1500")!=1) {
+    printf("stall request failed\n");
+    _exit(1);
+  }
+  uint32_t gapStall = runLoop(4000);
+  printf("%s: gap_ms before %u, with %ums stall %u, %u loop() calls in 1500ms\n",
+    RENDER_THREAD ? "render thread" : "single thread", (unsigned)gapBefore, (unsigned)stallMs, (unsigned)gapStall,
+    (unsigned)loopsBefore
+  );
+  bool ok;
+  #if RENDER_THREAD
+  ok = gapStall<maxThreadedGapMs;
+  // loop() must not spin and take CPU time from the render thread
+  if (loopsBefore>1500) ok = false;
+  #else
+  ok = gapStall>=stallMs*9/10;
+  #endif
+  // state changes made by cloud calls are published by the application loop
+  cloudParams("brightness=77");
+  runLoop(1500);
+  printf("last event: %s\n", hostLastPublish.c_str());
+  if (hostLastPublish.find("brightness=77")==std::string::npos) ok = false;
+  // setting a color temperature switches to lamp mode (3), and is published as well
+  cloudVdsd("ct=300");
+  runLoop(1500);
+  printf("last event: %s\n", hostLastPublish.c_str());
+  if (hostLastPublish.find("ct=300")==std::string::npos || vdsdState()>>24!=mode_lamp) ok = false;
+  fflush(stdout);
+  _exit(ok ? 0 : 1); // render thread is still running, do not run destructors
+}
@@ -0,0 +1,50 @@
+// Renders messages with SELFTEST in all text layouts, at several text scales, with and without
+// smoothing, at every fractional scroll position step, and fails if the word-parallel text
+// renderer ever differs from the bitwise reference (renderTextBitwise()).
+
+#include "messagetorch.cpp"
+
+
+static const char *messages[] = {
+  "Hello World!",
+  "MW %C3%84%C3%96%C3%9C %C3%A4%C3%B6%C3%BC #@%25 iIl1 {x}", // wide, narrow and non-ASCII glyphs
+  "Word wrapping needs a somewhat longer message with several words",
+};
+
+static const int scales[] = { 25, 50, 100, 130, 150, 200, 350 };
+
+
+int main()
+{
+  setup();
+  handleParams("text_repeats=0,mode=0");
+  int failed = 0;
+  for (int layout=0; layout<3; layout++) {
+    for (size_t si=0; si<sizeof(scales)/sizeof(scales[0]); si++) {
+      for (int smooth=0; smooth<2; smooth++) {
+        for (size_t m=0; m<sizeof(messages)/sizeof(messages[0]); m++) {
+          char params[80];
+          snprintf(params, sizeof(params), "text_layout=%d,text_scale=%d,text_smooth=%d,text_base_line=%d", layout, scales[si], smooth, (int)(m*5));
+          handleParams(params);
+          newMessage(messages[m]);
+          uint16_t errors = selftestErrors;
+          uint32_t checks = selftestChecks;
+          // all the way through, in steps not aligned to pixels
+          int32_t endPos = (layout==text_vertical ? levels : textWidth)*256;
+          for (int32_t pos=textStartPos(); pos<=endPos; pos+=37) {
+            textPos = pos;
+            renderText();
+          }
+          errors = selftestErrors-errors;
+          checks = selftestChecks-checks;
+          if (errors>0 || checks==0) {
+            printf("%s, message %d: %u of %u frames differ\n", params, (int)m, (unsigned)errors, (unsigned)checks);
+            failed++;
+          }
+        }
+      }
+    }
+  }
+  printf("%u frames checked, %d configurations failed\n", (unsigned)selftestChecks, failed);
+  return failed ? 1 : 0;
+}
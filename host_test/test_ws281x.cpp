@@ -0,0 +1,174 @@
+// Decodes the SPI byte stream p44_ws2812 generates for WS281x type LEDs the way the LEDs
+// would, and checks the bit timing against the LED type's limits (with the shortest and the
+// longest pause between SPI bytes), and the data against the colors that were set.
+
+#include "messagetorch.cpp"
+
+
+// decoder for a WS281x bitstream generated via SPI
+class WS281xDecoder {
+
+  uint32_t bitNs; // duration of a SPI bit
+  uint32_t gapNs; // pause between SPI bytes (line stays at level of last bit)
+  const WS281xTiming &timing;
+  bool level; // current line level
+  bool inBit; // set when a WS281x bit has started
+  bool inHigh; // set while the current WS281x bit is in its high phase
+  uint32_t highNs; // time the current WS281x bit was high
+  uint32_t periodNs; // time since start of the current WS281x bit
+  uint8_t byteBits; // number of WS281x bits decoded into byteVal
+
+  void finishBit(bool aLast)
+  {
+    bool one;
+    if (highNs>=timing.t0hMin && highNs<=timing.t0hMax) {
+      one = false;
+    }
+    else if (highNs>=timing.t1hMin && highNs<=timing.t1hMax) {
+      one = true;
+    }
+    else {
+      // high time out of limits, guess
+      timingErrors++;
+      one = 2*highNs > (uint32_t)timing.t0hMax+timing.t1hMin;
+    }
+    // last bit's low time and period end with the reset (latch) pause, can't be checked
+    if (!aLast) {
+      uint32_t lowNs = periodNs-highNs;
+      if (one ? lowNs<timing.t1lMin || lowNs>timing.t1lMax : lowNs<timing.t0lMin || lowNs>timing.t0lMax) timingErrors++;
+      if (periodNs<timing.periodMin || periodNs>timing.periodMax) timingErrors++;
+    }
+    byteVal = (byteVal<<1) | (one ? 1 : 0);
+    if (++byteBits>=8) {
+      decoded.push_back(byteVal);
+      byteBits = 0;
+      byteVal = 0;
+    }
+  }
+
+public:
+  std::vector<uint8_t> decoded; // bytes decoded
+  uint8_t byteVal; // decoded bits of incomplete byte
+  int timingErrors; // number of bits with timing violating the limits
+
+  WS281xDecoder(uint32_t aBitNs, uint32_t aGapNs, const WS281xTiming &aTiming) :
+    bitNs(aBitNs), gapNs(aGapNs), timing(aTiming),
+    level(false), inBit(false), inHigh(false), highNs(0), periodNs(0), byteBits(0),
+    byteVal(0), timingErrors(0)
+  {
+  }
+
+  // feed all bytes sent, returns false if there were incomplete bytes
+  bool decode(const std::vector<uint8_t> &aSpiBytes)
+  {
+    for (size_t i=0; i<aSpiBytes.size(); i++) {
+      uint8_t spiByte = aSpiBytes[i];
+      for (int j=0; j<8; j++) {
+        bool b = spiByte & 0x80;
+        spiByte = spiByte << 1;
+        if (b && !level) {
+          // rising edge: previous bit complete, next one starts
+          if (inBit) finishBit(false);
+          inBit = true;
+          inHigh = true;
+          highNs = 0;
+          periodNs = 0;
+        }
+        level = b;
+        if (!level) inHigh = false;
+        if (inBit) {
+          periodNs += bitNs;
+          if (inHigh) highNs += bitNs;
+        }
+      }
+      // pause between bytes extends the current level
+      if (inBit) {
+        periodNs += gapNs;
+        if (inHigh) highNs += gapNs;
+      }
+    }
+    if (inBit) finishBit(true);
+    return byteBits==0;
+  }
+};
+
+
+// what the LEDs should receive for the colors set, derived independently from the encoder
+std::vector<uint8_t> expectedBytes(p44_ws2812 &aLeds, p44_ws2812::LedType aType)
+{
+  static const char channelOrder[3][5] = { "brg", "grb", "grbw" };
+  std::vector<uint8_t> exp;
+  for (int i=0; i<aLeds.getNumPixels(); i++) {
+    byte r, g, b;
+    aLeds.getColor(i, r, g, b);
+    uint8_t pr = pwmTable[r>>3];
+    uint8_t pg = pwmTable[g>>3];
+    uint8_t pb = pwmTable[b>>3];
+    uint8_t w = 0;
+    if (aType==p44_ws2812::sk6812_rgbw) {
+      w = pr;
+      if (pg<w) w = pg;
+      if (pb<w) w = pb;
+    }
+    for (const char *c = channelOrder[aType]; *c; c++) {
+      switch (*c) {
+        case 'r': exp.push_back(pr-w); break;
+        case 'g': exp.push_back(pg-w); break;
+        case 'b': exp.push_back(pb-w); break;
+        case 'w': exp.push_back(w); break;
+      }
+    }
+  }
+  return exp;
+}
+
+
+int testLedType(p44_ws2812::LedType aType, const char *aName)
+{
+  const int n = 50;
+  p44_ws2812 testLeds(aType, n);
+  testLeds.begin();
+  int errors = 0;
+  for (int frame=0; frame<20; frame++) {
+    for (int i=0; i<n; i++) {
+      // all full and empty channel values, and random ones
+      if (frame<2) testLeds.setColor(i, frame ? 255 : 0, i&1 ? 255 : 0, i&2 ? 255 : 0);
+      else testLeds.setColor(i, rand() & 0xFF, rand() & 0xFF, rand() & 0xFF);
+    }
+    hostSpiBytes.clear();
+    hostSpiCapture = true;
+    testLeds.show();
+    hostSpiCapture = false;
+    // check with the shortest and the longest pause between SPI bytes the platform has
+    static const uint32_t gaps[2] = { P44_SPI_BYTE_GAP_MIN_NS, P44_SPI_BYTE_GAP_MAX_NS };
+    for (int g=0; g<2; g++) {
+      WS281xDecoder decoder(testLeds.getSpiBitNs(), gaps[g], ws281xTimings[aType]);
+      if (!decoder.decode(hostSpiBytes)) {
+        printf("%s: frame %d, gap %unS: incomplete byte at end\n", aName, frame, (unsigned)gaps[g]);
+        errors++;
+      }
+      if (decoder.timingErrors) {
+        printf("%s: frame %d, gap %unS: %d bits with timing out of limits\n", aName, frame, (unsigned)gaps[g], decoder.timingErrors);
+        errors++;
+      }
+      if (decoder.decoded!=expectedBytes(testLeds, aType)) {
+        printf("%s: frame %d, gap %unS: data decoded does not match colors set\n", aName, frame, (unsigned)gaps[g]);
+        errors++;
+      }
+    }
+  }
+  printf("%s: SPI bit %uns, %u SPI bits per bit, %d errors\n",
+    aName, (unsigned)testLeds.getSpiBitNs(), (unsigned)testLeds.getSpiBitsPerBit(), errors
+  );
+  return errors;
+}
+
+
+int main()
+{
+  int errors = 0;
+  errors += testLedType(p44_ws2812::ws2811_brg, "WS2811");
+  errors += testLedType(p44_ws2812::ws2812, "WS2812");
+  errors += testLedType(p44_ws2812::sk6812_rgbw, "SK6812");
+  return errors ? 1 : 0;
+}
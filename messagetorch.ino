@@ -41,19 +41,42 @@ const bool mirrorText = false;
 // Set this to the LED type in use.
 // - ws2811_brg is WS2811 driver chip wired to LEDs in B,R,G order
 // - ws2812 is WS2812 LED chip in standard order for this chip: G,R,B
+// - sk6812_rgbw is SK6812 RGBW LED chip (G,R,B,W), white is extracted from the RGB values
+// - apa102 is APA102 LED chip with clock and data lines (SPI SCK and MOSI)
+// - sk9822 is SK9822 LED chip (APA102 clone, needs an additional reset frame)
 #define LED_TYPE p44_ws2812::ws2812
 
 
+// Maximum supersampling factor for the torch simulation (see sim_scale parameter).
+// The energy buffers are allocated for this factor, so memory needed grows with its square.
+// Set to 1 to save memory when supersampling is not needed.
+const int maxSimScale = 2;
+
+
 // define this to 1 to disable Cheerlights part of the code (to save memory)
 #define NO_CHEERLIGHT 1
 
 // define this to 1 to disable digitalSTROM part of the code (to save memory)
 //#define NO_DIGITALSTROM 1
 
+// define this to 1 to check optimized code paths against straightforward reference
+// implementations while running. Errors are counted in the "stats" cloud variable.
+// Note: costs a lot of performance, only for development
+//#define SELFTEST 1
+
+// rendering runs in its own thread where the platform supports it (Photon and later, not Spark Core),
+// so frames keep coming while the system is busy with the cloud connection
+#if defined(PLATFORM_THREADING) && PLATFORM_THREADING
+  #define RENDER_THREAD 1
+#else
+  #define RENDER_THREAD 0
+#endif
+
 
 /*
  * Spark Core library to control WS2812 based RGB LED devices
  * using SPI to create bitstream.
+ * Also drives APA102/SK9822 LEDs, which take clock+data directly from SPI
  * Future plan is to use DMA to feed the SPI, so WS2812 bitstream
  * can be produced without CPU load and without blocking IRQs
  *
@@ -66,12 +89,45 @@ const bool mirrorText = false;
 // Declaration (would go to .h file once library is separated)
 // ===========================================================
 
+// SPI peripheral clock (before divider), and the range of the pause between two bytes sent
+// with SPI.transfer() (during which the line remains at the level of the last bit), per platform.
+// Only platforms where the SPI divider and the pause are known are supported.
+#if !defined(PLATFORM_ID) || PLATFORM_ID==0
+  // Spark Core: SPI1 on APB2 at 72MHz
+  #define P44_SPI_BASE_CLOCK 72000000
+  #define P44_SPI_BYTE_GAP_MIN_NS 100
+  #define P44_SPI_BYTE_GAP_MAX_NS 300
+#elif PLATFORM_ID==6 || PLATFORM_ID==8 || PLATFORM_ID==10
+  // Photon, P1, Electron: SPI on APB2 at 60MHz
+  #define P44_SPI_BASE_CLOCK 60000000
+  #define P44_SPI_BYTE_GAP_MIN_NS 100
+  #define P44_SPI_BYTE_GAP_MAX_NS 300
+#else
+  #error "SPI clock and byte timing of this platform not known, WS281x timing cannot be selected"
+#endif
+
+// max SPI clock for APA102/SK9822 (chips can do more, but long chains and wires can't)
+#define P44_CLOCKED_MAX_CLOCK 10000000
+
+/// WS281x bit timing limits, all in nS
+typedef struct {
+  uint16_t t0hMin, t0hMax; // high time of a 0 bit
+  uint16_t t1hMin, t1hMax; // high time of a 1 bit
+  uint16_t t0lMin, t0lMax; // low time of a 0 bit
+  uint16_t t1lMin, t1lMax; // low time of a 1 bit
+  uint16_t periodMin, periodMax; // total duration of a bit
+} WS281xTiming;
+
+
 class p44_ws2812 {
 
 public:
   typedef enum {
     ws2811_brg,
-    ws2812
+    ws2812,
+    sk6812_rgbw,
+    apa102,
+    sk9822
   } LedType;
 
 private:
@@ -92,6 +148,19 @@ private:
   bool yReversed; // Y reversed
   bool alternating; // direction changes after every row
   bool swapXY; // swap X and Y
+  uint8_t spiDivider; // SPI_CLOCK_DIVxx value
+  uint16_t spiBitNs; // duration of one SPI bit in nS
+  uint8_t bitsPerWSBit; // number of SPI bits per WS281x bit
+  uint8_t onePattern; // SPI bit pattern for a WS281x 1 bit (in the lowest bitsPerWSBit bits)
+  uint8_t zeroPattern; // SPI bit pattern for a WS281x 0 bit
+  uint32_t encodedBits; // encoded bits not yet sent
+  uint8_t numEncodedBits; // number of bits in encodedBits
+  uint16_t chunkLeds; // if>0, IRQs are enabled briefly after every chunkLeds LEDs
+  uint16_t maxGapUs; // pause between chunks considered safe
+  uint16_t chunkBackoff; // number of frames to send without chunking after a too long pause
+  uint32_t irqOffMaxUs; // longest time IRQs were disabled
+  uint32_t longGaps; // number of pauses that took longer than maxGapUs
+  uint32_t resetGaps; // number of pauses that took so long that LEDs probably latched in mid-frame
 
 public:
   /// create driver for a WS2812 LED chain
@@ -147,9 +216,36 @@ public:
   /// @return number of Pixels in Y direction
   uint16_t getSizeY();
 
+  /// send frames in chunks, enabling IRQs briefly between chunks
+  /// @param aChunkLeds number of LEDs per chunk, 0 to send entire frame with IRQs disabled
+  /// @param aMaxGapUs max acceptable pause between chunks (must be well below the LEDs' reset time of 50uS).
+  ///   When a pause takes longer, IRQs remain disabled for the rest of the frame, and the next
+  ///   frames are sent without chunking.
+  void setChunking(uint16_t aChunkLeds, uint16_t aMaxGapUs);
+
+  /// @return longest time IRQs were disabled so far, in uS (and reset it)
+  uint32_t getIrqOffMaxUs() { uint32_t m = irqOffMaxUs; irqOffMaxUs = 0; return m; };
+  /// @return number of pauses between chunks longer than the max gap
+  uint32_t getLongGaps() { return longGaps; };
+  /// @return number of pauses between chunks long enough to reset the LEDs
+  uint32_t getResetGaps() { return resetGaps; };
+
+  /// @return true if LED type has a clock line (APA102 style), false for WS281x single wire timing
+  bool isClocked() { return ledType>=apa102; };
+
+  /// @return duration of one SPI bit in nS
+  uint16_t getSpiBitNs() { return spiBitNs; };
+  /// @return number of SPI bits used per WS281x bit
+  uint8_t getSpiBitsPerBit() { return bitsPerWSBit; };
+
 private:
 
   uint16_t ledIndexFromXY(uint16_t aX, uint16_t aY);
+  inline void sendSPI(uint8_t aByte);
+  void selectTiming();
+  inline void sendWSByte(uint8_t aByte);
+  void flushWSBits();
+  void showClocked();
 
 
 };
@@ -159,8 +255,26 @@ private:
 // Implementation (would go to .cpp file once library is separated)
 // ================================================================
 
+// bit timing limits per LED type
+// Note: low times are less critical than high times (which decide between 0 and 1), the LED
+// just needs to see the line low before the next bit starts, and not long enough for a reset,
+// so the low time limits are relaxed further
+static const WS281xTiming ws281xTimings[3] = {
+  // WS2811 (low speed mode): datasheet asks for T0H=500nS, T1H=1200nS, T0L=2000nS, T1L=1300nS,
+  // period=2500nS +/-150nS, but shorter timing is known to work well, so limits are somewhat relaxed
+  { 200, 650, 900, 1500, 650, 2600, 300, 2000, 1700, 3100 },
+  // WS2812: T0H=350nS, T1H=700nS (WS2812B: 400/800nS), T0L=800nS, T1L=600nS +/-150nS,
+  // period 1250nS +/-600nS
+  { 200, 500, 550, 950, 450, 1400, 300, 1400, 650, 1850 },
+  // SK6812: T0H=300nS, T1H=600nS, T0L=900nS, T1L=600nS +/-150nS, period 1250nS +/-600nS
+  { 150, 450, 450, 750, 450, 1400, 300, 1400, 650, 1850 }
+};
+
 static const uint8_t pwmTable[32] = {0, 1, 1, 2, 3, 4, 6, 7, 9, 10, 13, 15, 18, 21, 24, 28, 33, 38, 44, 50, 58, 67, 77, 88, 101, 115, 132, 150, 172, 196, 224, 255};
 
+// same curve as pwmTable, but in 1/31 PWM steps (for APA102 PWM*global brightness/31)
+static const uint16_t pwmTableHiRes[32] = {0, 23, 50, 79, 113, 151, 194, 243, 298, 360, 430, 510, 600, 702, 818, 948, 1096, 1263, 1451, 1665, 1907, 2180, 2489, 2839, 3234, 3681, 4187, 4760, 5407, 6140, 6968, 7905};
+
 p44_ws2812::p44_ws2812(LedType aLedType, uint16_t aNumLeds, uint16_t aPixelsPerRow, bool aXReversed, bool aAlternating, bool aSwapXY, bool aYReversed, uint16_t aLedsPerPixel)
 {
   numLeds = aNumLeds; // raw number of LEDs
@@ -176,6 +290,12 @@ p44_ws2812::p44_ws2812(LedType aLedType, uint16_t aNumLeds, uint16_t aPixelsPerR
     pixelsPerRow = aPixelsPerRow; // set row size
     numRows = (numPixels-1)/pixelsPerRow+1; // calculate number of (full or partial) rows
   }
+  chunkLeds = 0;
+  maxGapUs = 20;
+  chunkBackoff = 0;
+  irqOffMaxUs = 0;
+  longGaps = 0;
+  resetGaps = 0;
   xReversed = aXReversed;
   alternating = aAlternating;
   swapXY = aSwapXY;
@@ -189,7 +309,7 @@ p44_ws2812::p44_ws2812(LedType aLedType, uint16_t aNumLeds, uint16_t aPixelsPerR
 p44_ws2812::~p44_ws2812()
 {
   // free the buffer
-  if (pixelBufferP) delete pixelBufferP;
+  if (pixelBufferP) delete[] pixelBufferP;
 }
 
 
@@ -213,87 +333,242 @@ uint16_t p44_ws2812::getSizeY()
 
 
 
+// Choose SPI clock divider and bit patterns for the LED type's timing on this platform's SPI clock.
+// Tries 3, 4, 5 and 8 SPI bits per WS281x bit, and prefers the fewest bits (= bytes per LED),
+// then the patterns with most margin to the high time limits.
+// Note: the pause between SPI bytes extends the part of a WS281x bit it falls into. It varies
+// between P44_SPI_BYTE_GAP_MIN_NS and P44_SPI_BYTE_GAP_MAX_NS, but WS281x bits not containing
+// a byte boundary get no pause at all, so timing must be valid without pause as well as with
+// the longest one. With 4 and 8 bits, byte boundaries only fall into the low part of WS281x bits,
+// with 3 and 5 bits into the high part as well.
+void p44_ws2812::selectTiming()
+{
+  static const uint8_t dividers[8] = {
+    SPI_CLOCK_DIV2, SPI_CLOCK_DIV4, SPI_CLOCK_DIV8, SPI_CLOCK_DIV16,
+    SPI_CLOCK_DIV32, SPI_CLOCK_DIV64, SPI_CLOCK_DIV128, SPI_CLOCK_DIV256
+  };
+  static const uint8_t bitCounts[4] = { 3, 4, 5, 8 };
+  if (isClocked()) {
+    // no timing constraints, just the fastest clock the chain can handle
+    bitsPerWSBit = 1;
+    for (int d=0; d<8; d++) {
+      spiDivider = dividers[d];
+      spiBitNs = 1000000000/(P44_SPI_BASE_CLOCK/(2<<d));
+      if (P44_SPI_BASE_CLOCK/(2<<d)<=P44_CLOCKED_MAX_CLOCK) break;
+    }
+    return;
+  }
+  const WS281xTiming &t = ws281xTimings[ledType];
+  // fallback: the timing used on the Spark Core before timing selection existed
+  spiDivider = SPI_CLOCK_DIV8;
+  spiBitNs = 1000000000/(P44_SPI_BASE_CLOCK/8);
+  bitsPerWSBit = 8;
+  zeroPattern = 0x70;
+  onePattern = 0x7E;
+  uint8_t bestBits = 0xFF;
+  int bestMargin = -1;
+  for (int d=0; d<8; d++) {
+    uint32_t bitNs = 1000000000/(P44_SPI_BASE_CLOCK/(2<<d));
+    for (int bc=0; bc<4; bc++) {
+      uint8_t n = bitCounts[bc];
+      if (n>bestBits) break;
+      uint32_t highGap = 8%n==0 ? 0 : P44_SPI_BYTE_GAP_MAX_NS; // possible extension of high time
+      uint32_t lowGap = P44_SPI_BYTE_GAP_MAX_NS; // possible extension of low time
+      uint32_t period = n*bitNs;
+      if (period<t.periodMin || period+P44_SPI_BYTE_GAP_MAX_NS>t.periodMax) continue;
+      for (uint8_t h0=1; h0<n-1; h0++) {
+        uint32_t t0h = h0*bitNs;
+        uint32_t t0l = period-t0h;
+        if (t0h<t.t0hMin || t0h+highGap>t.t0hMax) continue;
+        if (t0l<t.t0lMin || t0l+lowGap>t.t0lMax) continue;
+        for (uint8_t h1=h0+1; h1<n; h1++) {
+          uint32_t t1h = h1*bitNs;
+          uint32_t t1l = period-t1h;
+          if (t1h<t.t1hMin || t1h+highGap>t.t1hMax) continue;
+          if (t1l<t.t1lMin || t1l+lowGap>t.t1lMax) continue;
+          // valid, check margin (smallest distance to any limit)
+          int margin = t0h-t.t0hMin;
+          if ((int)(t.t0hMax-t0h-highGap)<margin) margin = t.t0hMax-t0h-highGap;
+          if ((int)(t1h-t.t1hMin)<margin) margin = t1h-t.t1hMin;
+          if ((int)(t.t1hMax-t1h-highGap)<margin) margin = t.t1hMax-t1h-highGap;
+          if (n<bestBits || margin>bestMargin) {
+            bestBits = n;
+            bestMargin = margin;
+            spiDivider = dividers[d];
+            spiBitNs = bitNs;
+            bitsPerWSBit = n;
+            // high bits first, then low bits
+            zeroPattern = ((1<<h0)-1)<<(n-h0);
+            onePattern = ((1<<h1)-1)<<(n-h1);
+          }
+        }
+      }
+    }
+  }
+}
+
+
 void p44_ws2812::begin()
 {
   // begin using the driver
   SPI.begin();
-  switch (ledType) {
-    case ws2811_brg:
-      SPI.setClockDivider(SPI_CLOCK_DIV16); // WS2811: System clock is 72MHz, we need 4.5MHz for SPI
-      break;
-    case ws2812:
-      SPI.setClockDivider(SPI_CLOCK_DIV8); // WS2812: System clock is 72MHz, we need 9MHz for SPI
-      break;
-  }
+  selectTiming();
+  SPI.setClockDivider(spiDivider);
   SPI.setBitOrder(MSBFIRST); // MSB first for easier scope reading :-)
+  SPI.setDataMode(SPI_MODE0); // APA102 samples data on rising clock edge
   SPI.transfer(0); // make sure SPI line starts low (Note: SPI line remains at level of last sent bit, fortunately)
 }
 
+inline void p44_ws2812::sendSPI(uint8_t aByte)
+{
+  SPI.transfer(aByte);
+}
+
+
+// encode a byte into bitsPerWSBit SPI bits per bit, send complete SPI bytes
+inline void p44_ws2812::sendWSByte(uint8_t aByte)
+{
+  for (byte j=0; j<8; j++) {
+    encodedBits = (encodedBits<<bitsPerWSBit) | (aByte & 0x80 ? onePattern : zeroPattern);
+    numEncodedBits += bitsPerWSBit;
+    while (numEncodedBits>=8) {
+      numEncodedBits -= 8;
+      sendSPI(encodedBits>>numEncodedBits);
+    }
+    aByte = aByte << 1;
+  }
+}
+
+
+// send remaining encoded bits, padded with low bits
+void p44_ws2812::flushWSBits()
+{
+  if (numEncodedBits>0) {
+    sendSPI(encodedBits<<(8-numEncodedBits));
+    numEncodedBits = 0;
+  }
+}
+
+
+void p44_ws2812::setChunking(uint16_t aChunkLeds, uint16_t aMaxGapUs)
+{
+  chunkLeds = aChunkLeds;
+  maxGapUs = aMaxGapUs;
+  chunkBackoff = 0;
+}
+
+
 void p44_ws2812::show()
 {
+  if (isClocked()) {
+    showClocked();
+    return;
+  }
+  numEncodedBits = 0;
+  bool chunking = chunkLeds>0 && chunkBackoff==0;
+  if (chunkBackoff>0) chunkBackoff--;
+  uint16_t chunkCount = 0;
   // Note: on the spark core, system IRQs might happen which exceed 50uS
   // causing WS2812 chips to reset in midst of data stream.
   // Thus, until we can send via DMA, we need to disable IRQs while sending
+  // (or at least while sending a chunk, see setChunking())
   __disable_irq();
-  switch(ledType) {
-    case ws2811_brg: {
-      // transfer RGB values to LED chain
-      for (uint16_t i=0; i<numPixels; i++) {
-        RGBPixel *pixP = &(pixelBufferP[i]);
-        byte b;
-        for (uint16_t r=0; r<ledsPerPixel; r++) {
+  uint32_t offStart = micros();
+  // transfer RGB values to LED chain
+  for (uint16_t i=0; i<numPixels; i++) {
+    RGBPixel *pixP = &(pixelBufferP[i]);
+    for (uint16_t r=0; r<ledsPerPixel; r++) {
+      switch(ledType) {
+        case ws2811_brg:
           // Order of PWM data for WS2811 LEDs usually is BRG
-          // - blue
-          b = pwmTable[pixP->blue];
-          for (byte j=0; j<8; j++) {
-            SPI.transfer(b & 0x80 ? 0x7C : 0x40);
-            b = b << 1;
-          }
-          // - red
-          b = pwmTable[pixP->red];
-          for (byte j=0; j<8; j++) {
-            SPI.transfer(b & 0x80 ? 0x7C : 0x40);
-            b = b << 1;
-          }
-          // - green
-          b = pwmTable[pixP->green];
-          for (byte j=0; j<8; j++) {
-            SPI.transfer(b & 0x80 ? 0x7C : 0x40);
-            b = b << 1;
-          }
+          sendWSByte(pwmTable[pixP->blue]);
+          sendWSByte(pwmTable[pixP->red]);
+          sendWSByte(pwmTable[pixP->green]);
+          break;
+        case ws2812:
+          // Order of PWM data for WS2812 LEDs is G-R-B
+          sendWSByte(pwmTable[pixP->green]);
+          sendWSByte(pwmTable[pixP->red]);
+          sendWSByte(pwmTable[pixP->blue]);
+          break;
+        case sk6812_rgbw: {
+          // Order of PWM data for SK6812 RGBW LEDs is G-R-B-W
+          // common part of R,G,B goes to the white LED instead (branch-free min)
+          int r = pwmTable[pixP->red];
+          int g = pwmTable[pixP->green];
+          int b = pwmTable[pixP->blue];
+          int w = r + ((g-r) & ((g-r)>>31));
+          w = w + ((b-w) & ((b-w)>>31));
+          sendWSByte(g-w);
+          sendWSByte(r-w);
+          sendWSByte(b-w);
+          sendWSByte(w);
+          break;
         }
+        default:
+          break;
       }
     }
-    case ws2812: {
-      // transfer RGB values to LED chain
-      for (uint16_t i=0; i<numPixels; i++) {
-        RGBPixel *pixP = &(pixelBufferP[i]);
-        byte b;
-        for (uint16_t r=0; r<ledsPerPixel; r++) {
-          // Order of PWM data for WS2812 LEDs is G-R-B
-          // - green
-          b = pwmTable[pixP->green];
-          for (byte j=0; j<8; j++) {
-            SPI.transfer(b & 0x80 ? 0x7E : 0x70);
-            b = b << 1;
-          }
-          // - red
-          b = pwmTable[pixP->red];
-          for (byte j=0; j<8; j++) {
-            SPI.transfer(b & 0x80 ? 0x7E : 0x70);
-            b = b << 1;
-          }
-          // - blue
-          b = pwmTable[pixP->blue];
-          for (byte j=0; j<8; j++) {
-            SPI.transfer(b & 0x80 ? 0x7E : 0x70);
-            b = b << 1;
-          }
-        }
+    if (chunking && ++chunkCount>=chunkLeds && i<numPixels-1) {
+      // end of chunk (24 or 32 WS281x bits always end on a SPI byte boundary)
+      chunkCount = 0;
+      uint32_t now = micros();
+      if (now-offStart>irqOffMaxUs) irqOffMaxUs = now-offStart;
+      // let pending IRQs run
+      __enable_irq();
+      __disable_irq();
+      offStart = micros();
+      uint32_t gap = offStart-now;
+      if (gap>maxGapUs) {
+        // too long, no more chunking in this frame and the next ones
+        longGaps++;
+        if (gap>=50) resetGaps++;
+        chunking = false;
+        chunkBackoff = 100;
       }
     }
-  } // switch
+  }
+  flushWSBits();
+  uint32_t offTime = micros()-offStart;
   __enable_irq();
+  if (offTime>irqOffMaxUs) irqOffMaxUs = offTime;
+}
+
+
+// APA102/SK9822: clocked by SPI, so no timing constraints, and IRQs can stay enabled.
+// Each LED gets a 5-bit global brightness in addition to the 8-bit PWM values, which is used
+// to get finer steps at the dim end: the brightness is chosen as low as possible for the
+// brightest channel, so the PWM values can use their full resolution.
+void p44_ws2812::showClocked()
+{
+  // start frame
+  for (int i=0; i<4; i++) SPI.transfer(0);
+  for (uint16_t i=0; i<numPixels; i++) {
+    RGBPixel *pixP = &(pixelBufferP[i]);
+    uint16_t r = pwmTableHiRes[pixP->red];
+    uint16_t g = pwmTableHiRes[pixP->green];
+    uint16_t b = pwmTableHiRes[pixP->blue];
+    uint16_t m = r>g ? r : g;
+    if (b>m) m = b;
+    // global brightness 1..31 so that max PWM value is <=255
+    uint8_t gb = (m+254)/255;
+    if (gb==0) gb = 1;
+    uint8_t pr = (r+gb/2)/gb;
+    uint8_t pg = (g+gb/2)/gb;
+    uint8_t pb = (b+gb/2)/gb;
+    for (uint16_t l=0; l<ledsPerPixel; l++) {
+      SPI.transfer(0xE0|gb);
+      SPI.transfer(pb);
+      SPI.transfer(pg);
+      SPI.transfer(pr);
+    }
+  }
+  // SK9822 only shows the data with the next frame start, unless an extra reset frame is sent
+  if (ledType==sk9822) {
+    for (int i=0; i<4; i++) SPI.transfer(0);
+  }
+  // end frame: data is delayed by half a clock per LED, so need numLeds/2 more clocks to push it through
+  for (uint16_t i=0; i<(numLeds+15)/16; i++) SPI.transfer(0);
 }
 
 
@@ -405,6 +680,24 @@ inline void reduce(byte &aByte, byte aAmount, byte aMin = 0)
 }
 
 
+// cheap hash for noise
+inline int8_t noiseHash(uint32_t aN)
+{
+  aN = (aN<<13) ^ aN;
+  aN = aN*(aN*aN*15731+789221)+1376312589;
+  return (int8_t)(aN>>16);
+}
+
+
+// smooth 1D value noise, aPos in 1/256 steps between random values, returns -128..127
+int noise(uint32_t aPos)
+{
+  int a = noiseHash(aPos>>8);
+  int b = noiseHash((aPos>>8)+1);
+  return a+(((b-a)*(int)(aPos & 0xFF))>>8);
+}
+
+
 inline void increase(byte &aByte, byte aAmount, byte aMax = 255)
 {
   int r = aByte+aAmount;
@@ -619,16 +912,23 @@ enum {
 };
 
 byte mode = mode_torch; // main operation mode
+bool needsRefresh = true; // set when display must be recalculated and sent to LEDs even in static modes
+bool paletteValid = false; // set to false when torch colors or brightness change
 int brightness = 255; // overall brightness
 byte fade_base = 140; // crossfading base brightness level
 
 // text params
 
 int text_intensity = 255; // intensity of last column of text (where text appears)
+int text_speed = 16; // text scrolling speed in pixels per second (0 = cycles_per_px frames per pixel)
 int cycles_per_px = 5;
 int text_repeats = 15; // text displays until faded down to almost zero
 int fade_per_repeat = 15; // how much to fade down per repeat
 int text_base_line = 8;
+int text_layout = 0; // see TextLayout enum
+int text_scale = 100; // text size in percent of the font's size
+const int maxTextScale = 800; // largest text_scale, glyphs are 56 pixels high then, textBitmap still holds a few of them
+byte text_smooth = 0; // if set, scaled glyphs are smoothed, otherwise pixels are just repeated
 byte red_text = 0;
 byte green_text = 255;
 byte blue_text = 180;
@@ -640,6 +940,10 @@ int clock_interval = 0; // 15*60; // by default, show clock every 15 mins (0=nev
 int clock_zone = 2; // UTC+2 = CEST = Central European Summer Time
 char clock_fmt[30] = "%k:%M"; // use format specifiers from strftime, see e.g. http://linux.die.net/man/3/strftime. %k:%M is 24h hour/minute clock
 
+// message history parameters
+
+int history_idle = 0; // if>0, messages from history are shown again after this many seconds without a message (0=never)
+
 // torch parameters
 
 uint16_t cycle_wait = 1; // 0..255
@@ -656,8 +960,21 @@ uint16_t spark_cap = 200; // 0..255: spark cells: how much energy is retained fr
 
 uint16_t up_rad = 40; // up radiation
 uint16_t side_rad = 35; // sidewards radiation
+uint16_t diag_rad = 0; // diagonal (from lower left and right) radiation
 uint16_t heat_cap = 0; // 0..255: passive cells: how much energy is retained from previous cycle
 
+// energy propagation kernel for passive cells: weights of the neighbour cells' energy, in 1/512.
+// Rows are: row above, own row, row below; columns are x-2..x+2.
+// Usually derived from up_rad, side_rad and diag_rad, but can be set directly with the "kernel" parameter
+const int kernelRows = 3;
+const int kernelCols = 5;
+uint16_t kernel[kernelRows][kernelCols];
+bool kernelValid = false; // set to false when kernel or simulation resolution changes
+
+int wind = 0; // horizontal shift of energy rising from the row below, in 1/256 cells per row (negative = other direction)
+int wind_gust = 0; // amplitude of random variation of wind over time, same units
+int wind_swirl = 0; // amplitude of random variation of wind between rows, same units
+
 byte red_bg = 0;
 byte green_bg = 0;
 byte blue_bg = 0;
@@ -669,6 +986,12 @@ int green_energy = 145;
 int blue_energy = 0;
 
 byte upside_down = 0; // if set, flame (or rather: drop) animation is upside down. Text remains as-is
+byte track_rows = 1; // if set, only rows with energy (plus one above) are simulated, others just show background
+int sim_scale = 1; // 2..maxSimScale: simulate at sim_scale times LED resolution, -2..-n: simulate at 1/n LED resolution
+int sim_div = 1; // simulate only every sim_div-th frame, frames in between are interpolated
+uint16_t tx_chunk = 0; // if>0, LEDs are sent in chunks of this size, with IRQs enabled in between
+uint16_t tx_max_gap = 20; // max pause between chunks, in uS (must be well below the 50uS that would latch the LEDs)
+uint32_t frame_budget = 0; // if set, time per frame (in uS) that adaptive quality control tries to keep (0=no adaptive quality control)
 
 
 // lamp mode params
@@ -676,6 +999,7 @@ byte upside_down = 0; // if set, flame (or rather: drop) animation is upside dow
 byte lamp_red = 220;
 byte lamp_green = 220;
 byte lamp_blue = 200;
+int lamp_ct = 0; // color temperature of lamp in mired, 0 if lamp color was set as RGB
 
 
 #if !NO_CHEERLIGHT
@@ -686,6 +1010,219 @@ uint8_t cheer_fade_cycles = 30; // fade cheer color one brightness step every 30
 
 #endif
 
+const int maxBenchCycles = 20; // limits the time the benchmark blocks frames
+int benchCycles = 0; // if set, benchmark is run with this number of cycles before next frame
+
+#if SELFTEST
+int stall_ms = 0; // if set, the application loop blocks for this time once (simulates a network stall)
+#endif
+
+
+// Transitions
+// ===========
+
+// Numeric parameters registered in animParams can move to a new value over time instead
+// of jumping. The value is advanced in 16.16 fixed point every frame, by the elapsed time
+// multiplied with a fixed step per mS.
+
+// what must be recalculated when a parameter changes
+const uint8_t param_palette = 0x01; // torch color palette
+const uint8_t param_kernel = 0x02; // radiation kernel
+
+// type of parameter variable
+enum {
+  ptype_byte,
+  ptype_uint16,
+  ptype_int
+};
+
+typedef struct {
+  const char *name; // name in params
+  void *var; // parameter variable
+  uint8_t type; // ptype_xxx
+  uint8_t flags; // param_xxx
+} AnimParam;
+
+// first entries have fixed positions for use in code
+enum {
+  ramp_brightness,
+  ramp_lamp_red, // lamp colors in R,G,B order (used by setLampCT())
+  ramp_lamp_green,
+  ramp_lamp_blue
+};
+
+const AnimParam animParams[] = {
+  { "brightness", &brightness, ptype_int, param_palette },
+  { "lamp_red", &lamp_red, ptype_byte, 0 },
+  { "lamp_green", &lamp_green, ptype_byte, 0 },
+  { "lamp_blue", &lamp_blue, ptype_byte, 0 },
+  { "fade_base", &fade_base, ptype_byte, 0 },
+  { "red_text", &red_text, ptype_byte, 0 },
+  { "green_text", &green_text, ptype_byte, 0 },
+  { "blue_text", &blue_text, ptype_byte, 0 },
+  { "text_intensity", &text_intensity, ptype_int, 0 },
+  { "red_bg", &red_bg, ptype_byte, param_palette },
+  { "green_bg", &green_bg, ptype_byte, param_palette },
+  { "blue_bg", &blue_bg, ptype_byte, param_palette },
+  { "red_bias", &red_bias, ptype_byte, param_palette },
+  { "green_bias", &green_bias, ptype_byte, param_palette },
+  { "blue_bias", &blue_bias, ptype_byte, param_palette },
+  { "red_energy", &red_energy, ptype_int, param_palette },
+  { "green_energy", &green_energy, ptype_int, param_palette },
+  { "blue_energy", &blue_energy, ptype_int, param_palette },
+  { "up_rad", &up_rad, ptype_uint16, param_kernel },
+  { "side_rad", &side_rad, ptype_uint16, param_kernel },
+  { "diag_rad", &diag_rad, ptype_uint16, param_kernel },
+  { "heat_cap", &heat_cap, ptype_uint16, 0 },
+  { "spark_cap", &spark_cap, ptype_uint16, 0 },
+  { "spark_tfr", &spark_tfr, ptype_byte, 0 },
+  { "flame_min", &flame_min, ptype_byte, 0 },
+  { "flame_max", &flame_max, ptype_byte, 0 },
+  { "spark_min", &spark_min, ptype_byte, 0 },
+  { "spark_max", &spark_max, ptype_byte, 0 },
+  { "wind", &wind, ptype_int, 0 },
+  { "wind_gust", &wind_gust, ptype_int, 0 },
+  { "wind_swirl", &wind_swirl, ptype_int, 0 },
+};
+const int numRamps = sizeof(animParams)/sizeof(AnimParam);
+
+typedef struct {
+  int32_t value; // current value, 16.16 fixed point
+  int32_t target; // target value, 16.16 fixed point
+  int32_t stepPerMs; // change per mS, 16.16 fixed point, 0 if not running
+} Ramp;
+
+Ramp ramps[numRamps];
+uint32_t lastRampMs; // time of last runRamps()
+uint8_t pendingUpdates; // param_xxx flags of derived data to recalculate at start of next frame
+
+
+// @return index into animParams, -1 if aName is not an animatable parameter
+int findAnimParam(const String &aName)
+{
+  for (int i=0; i<numRamps; i++) {
+    if (aName==animParams[i].name) return i;
+  }
+  return -1;
+}
+
+
+int getRampedParam(int aRamp)
+{
+  const AnimParam &p = animParams[aRamp];
+  switch (p.type) {
+    case ptype_byte: return *(byte *)p.var;
+    case ptype_uint16: return *(uint16_t *)p.var;
+    default: return *(int *)p.var;
+  }
+}
+
+
+void setRampedParam(int aRamp, int aValue)
+{
+  const AnimParam &p = animParams[aRamp];
+  switch (p.type) {
+    case ptype_byte: *(byte *)p.var = aValue; break;
+    case ptype_uint16: *(uint16_t *)p.var = aValue; break;
+    default: *(int *)p.var = aValue; break;
+  }
+  needsRefresh = true;
+  pendingUpdates |= p.flags;
+}
+
+
+// move parameter to aTarget within aMs (0 = immediately, which also stops a running ramp)
+void rampTo(int aRamp, int aTarget, uint32_t aMs)
+{
+  Ramp &r = ramps[aRamp];
+  r.target = aTarget*65536;
+  if (aMs==0) {
+    r.stepPerMs = 0;
+    setRampedParam(aRamp, aTarget);
+    return;
+  }
+  if (r.stepPerMs==0) {
+    // not running, start from current value
+    r.value = getRampedParam(aRamp)*65536;
+  }
+  r.stepPerMs = (r.target-r.value)/(int32_t)aMs;
+  if (r.stepPerMs==0) r.stepPerMs = r.target>r.value ? 1 : -1; // very slow, but must end
+}
+
+
+// advance running ramps, called once per frame
+void runRamps()
+{
+  uint32_t now = millis();
+  int32_t dt = now-lastRampMs;
+  lastRampMs = now;
+  for (int i=0; i<numRamps; i++) {
+    Ramp &r = ramps[i];
+    if (r.stepPerMs==0) continue;
+    int32_t left = r.target-r.value;
+    int64_t step = (int64_t)r.stepPerMs*dt;
+    if ((left>=0 && step>=left) || (left<0 && step<=left)) {
+      // done
+      r.value = r.target;
+      r.stepPerMs = 0;
+      settingsChanged(); // save final value
+    }
+    else {
+      r.value += step;
+    }
+    int v = (r.value+0x8000)>>16;
+    if (v!=getRampedParam(i)) setRampedParam(i, v);
+  }
+  // recalculate derived data once for all parameters changed since last frame
+  if (pendingUpdates & param_kernel) setRadiationKernel();
+  if (pendingUpdates & param_palette) paletteValid = false;
+  pendingUpdates = 0;
+}
+
+
+// Color temperature
+// =================
+
+// lamp color for color temperatures from ctTableMin to ctTableMax mired (6667K..2000K),
+// in steps of ctTableStep. Adjust values here to calibrate the white tones for a particular LED type.
+const int ctTableMin = 150;
+const int ctTableMax = 500;
+const int ctTableStep = 25;
+const byte ctTable[][3] = {
+  { 255, 250, 255 }, // 150 mired = 6667K
+  { 255, 241, 229 },
+  { 255, 228, 206 }, // 200 mired = 5000K
+  { 255, 216, 185 },
+  { 255, 206, 166 }, // 250 mired = 4000K
+  { 255, 196, 148 },
+  { 255, 188, 131 },
+  { 255, 180, 115 },
+  { 255, 172, 100 },
+  { 255, 165,  85 },
+  { 255, 159,  70 }, // 400 mired = 2500K
+  { 255, 153,  56 },
+  { 255, 147,  42 },
+  { 255, 142,  28 },
+  { 255, 137,  14 }, // 500 mired = 2000K
+};
+
+
+// switch to lamp mode, and set lamp color to color temperature aMired, within aMs
+void setLampCT(int aMired, uint32_t aMs)
+{
+  mode = mode_lamp;
+  if (aMired<ctTableMin) aMired = ctTableMin;
+  if (aMired>ctTableMax) aMired = ctTableMax;
+  lamp_ct = aMired;
+  int i = (aMired-ctTableMin)/ctTableStep;
+  int frac = ((aMired-ctTableMin)%ctTableStep)*256/ctTableStep; // 1/256 of the way to the next entry
+  int next = i<(ctTableMax-ctTableMin)/ctTableStep ? i+1 : i;
+  for (int c=0; c<3; c++) {
+    int v = ctTable[i][c] + (((ctTable[next][c]-ctTable[i][c])*frac)>>8);
+    rampTo(ramp_lamp_red+c, v, aMs);
+  }
+}
+
 
 // Cloud API
 // =========
@@ -694,6 +1231,7 @@ uint8_t cheer_fade_cycles = 30; // fade cheer color one brightness step every 30
 int handleParams(String command)
 {
   //look for the matching argument "coffee" <-- max of 64 characters long
+  beginParamChanges();
   int p = 0;
   while (p<(int)command.length()) {
     int i = command.indexOf(',',p);
@@ -703,15 +1241,20 @@ int handleParams(String command)
     String key = command.substring(p,j);
     String value = command.substring(j+1,i);
     int val = value.toInt();
+    needsRefresh = true;
+    paletteValid = false;
+    // animatable params, optionally with transition time: key=value@ms
+    int ap = findAnimParam(key);
+    if (ap>=0) {
+      int k = value.indexOf('@');
+      rampTo(ap, val, k>=0 ? value.substring(k+1).toInt() : 0);
+      if (ap>=ramp_lamp_red && ap<=ramp_lamp_blue) lamp_ct = 0; // lamp color set as RGB
+    }
     // global params
-    if (key=="wait")
+    else if (key=="wait")
       cycle_wait = val;
     else if (key=="mode")
       mode = val;
-    else if (key=="brightness")
-      brightness = val;
-    else if (key=="fade_base")
-      fade_base = val;
     #if !NO_CHEERLIGHT
     // cheerlight params
     else if (key=="cheer_brightness")
@@ -720,30 +1263,34 @@ int handleParams(String command)
       cheer_fade_cycles = val;
     #endif
     // simple lamp params
-    else if (key=="lamp_red")
-      lamp_red = val;
-    else if (key=="lamp_green")
-      lamp_green = val;
-    else if (key=="lamp_blue")
-      lamp_blue = val;
-    // text color params
-    else if (key=="red_text")
-      red_text = val;
-    else if (key=="green_text")
-      green_text = val;
-    else if (key=="blue_text")
-      blue_text = val;
+    else if (key=="ct")
+      setLampCT(val, 0);
     // text params
-    else if (key=="cycles_per_px")
+    else if (key=="text_speed")
+      text_speed = val;
+    else if (key=="cycles_per_px") {
+      // frame rate dependent speed, as in older versions
       cycles_per_px = val;
+      text_speed = 0;
+    }
     else if (key=="text_repeats")
       text_repeats = val;
     else if (key=="text_base_line")
       text_base_line = val;
+    else if (key=="text_layout") {
+      text_layout = val;
+      restartText();
+    }
+    else if (key=="text_scale") {
+      text_scale = val<25 ? 25 : (val>maxTextScale ? maxTextScale : val);
+      restartText();
+    }
+    else if (key=="text_smooth") {
+      text_smooth = val;
+      restartText();
+    }
     else if (key=="fade_per_repeat")
       fade_per_repeat = val;
-    else if (key=="text_intensity")
-      text_intensity = val;
     // clock display params
     else if (key=="clock_interval")
       clock_interval = val;
@@ -751,59 +1298,71 @@ int handleParams(String command)
       value.toCharArray(clock_fmt, 30);
     else if (key=="clock_zone")
       clock_zone = val;
-    // torch color params
-    else if (key=="red_bg")
-      red_bg = val;
-    else if (key=="green_bg")
-      green_bg = val;
-    else if (key=="blue_bg")
-      blue_bg = val;
-    else if (key=="red_bias")
-      red_bias = val;
-    else if (key=="green_bias")
-      green_bias = val;
-    else if (key=="blue_bias")
-      blue_bias = val;
-    else if (key=="red_energy")
-      red_energy = val;
-    else if (key=="green_energy")
-      green_energy = val;
-    else if (key=="blue_energy")
-      blue_energy = val;
+    // message history params
+    else if (key=="history_idle")
+      history_idle = val;
+    else if (key=="replay")
+      replayHistory(val);
+    else if (key=="history_clear")
+      clearHistory();
     // torch params
     else if (key=="spark_prob") {
       random_spark_probability = val;
       resetEnergy();
     }
-    else if (key=="spark_cap")
-      spark_cap = val;
-    else if (key=="spark_tfr")
-      spark_tfr = val;
-    else if (key=="side_rad")
-      side_rad = val;
-    else if (key=="up_rad")
-      up_rad = val;
-    else if (key=="heat_cap")
-      heat_cap = val;
-    else if (key=="flame_min")
-      flame_min = val;
-    else if (key=="flame_max")
-      flame_max = val;
-    else if (key=="spark_min")
-      spark_min = val;
-    else if (key=="spark_max")
-      spark_max = val;
+    else if (key=="kernel") {
+      setKernel(value);
+      pendingUpdates &= ~param_kernel; // explicit kernel wins over rad params set before
+    }
     else if (key=="upside_down")
       upside_down = val;
+    else if (key=="track_rows")
+      track_rows = val;
+    else if (key=="sim_scale") {
+      sim_scale = val;
+      applyQuality();
+    }
+    else if (key=="sim_div") {
+      sim_div = val<1 ? 1 : val;
+      applyQuality();
+    }
+    else if (key=="frame_budget")
+      frame_budget = val;
+    else if (key=="tx_chunk") {
+      tx_chunk = val;
+      leds.setChunking(tx_chunk, tx_max_gap);
+    }
+    else if (key=="tx_max_gap") {
+      tx_max_gap = val;
+      leds.setChunking(tx_chunk, tx_max_gap);
+    }
+    else if (key=="bench")
+      benchCycles = val<1 ? 1 : (val>maxBenchCycles ? maxBenchCycles : val); // run later, between frames
+    #if SELFTEST
+    else if (key=="stall")
+      stall_ms = val;
+    #endif
     p = i+1;
   }
+  endParamChanges();
   return 1;
 }
 
 
 #if !NO_DIGITALSTROM
 
-const int VDSD_API_VERSION=2;
+// version 3: changes of state and brightness are published as "vdsd_state" events
+// version 4: brightness and state accept a transition time, as value@ms
+// version 5: scenes, recalled with scene=n[@ms] and stored with savescene=n
+// version 6: color temperature, as ct=mired[@ms], output type 3, also in "vdsd_state" events
+const int VDSD_API_VERSION=6;
+
+const uint32_t statePublishIntervalMs = 1000; // state events are published at most once per second
+
+uint32_t publishedState = 0; // state as last published
+int publishedBrightness = -1; // brightness as last published, -1 = none published yet
+int publishedCt = -1; // color temperature as last published
+uint32_t lastStatePublishMs = 0; // time of last state event
 
 // this function automagically gets called upon a matching POST request
 int handleVdsd(String command)
@@ -811,6 +1370,7 @@ int handleVdsd(String command)
   String cmd = command;
   String value;
   bool hasValue = false;
+  uint32_t transitionMs = 0;
   int j = command.indexOf('=');
   if (j>=0) {
     hasValue = true;
@@ -818,83 +1378,176 @@ int handleVdsd(String command)
     cmd = c;
     String v = command.substring(j+1);
     value = v;
+    // optional transition time: value@ms
+    int k = value.indexOf('@');
+    if (k>=0) {
+      transitionMs = value.substring(k+1).toInt();
+    }
   }
   if (cmd=="version") {
     // API version
     return VDSD_API_VERSION;
   }
   else if (cmd=="config") {
-    // 0xssiibboo, ss=# of sensors, ii=# of binary inputs, bb=# of buttons, oo=# output type (0=none, 1=on/off, 2=RGB)
-    return 0x00000002; // RGB output
+    // 0xssiibboo, ss=# of sensors, ii=# of binary inputs, bb=# of buttons, oo=# output type (0=none, 1=on/off, 2=RGB, 3=RGB+CT)
+    return 0x00000003; // RGB output with color temperature
   }
   else if (cmd=="brightness") {
     // primary output is brightness
     if (hasValue) {
-      brightness = value.toInt();
+      rampTo(ramp_brightness, value.toInt(), transitionMs);
+      needsRefresh = true;
+      paletteValid = false;
+      settingsChanged();
     }
     else {
       return brightness;
     }
   }
+  else if (cmd=="ct") {
+    // color temperature in mired, sets lamp color
+    if (hasValue) {
+      setLampCT(value.toInt(), transitionMs);
+      needsRefresh = true;
+      settingsChanged();
+    }
+    else {
+      return lamp_ct;
+    }
+  }
+  else if (cmd=="scene") {
+    // recall scene (0..numScenes-1), with optional transition time
+    if (hasValue) {
+      return recallScene(value.toInt(), transitionMs) ? 1 : -1;
+    }
+  }
+  else if (cmd=="savescene") {
+    // store current state and parameters as scene
+    if (hasValue) {
+      return saveScene(value.toInt()) ? 1 : -1;
+    }
+  }
   else if (cmd=="state") {
     // state is: 0xmmrrggbb, where mm=mode, rr/gg/bb = RGB for RGB modes or bb=brightness for non-RBG
     if (hasValue) {
       uint32_t v = value.toInt();
+      needsRefresh = true;
+      paletteValid = false;
+      settingsChanged();
       // get mode
       mode = (v>>24) & 0xFF;
       if (mode==mode_lamp) {
         // RGB Lamp
-        lamp_red = (v>>16) & 0xFF;
-        lamp_green = (v>>8) & 0xFF;
-        lamp_blue = v & 0xFF;
-        brightness = 0xFF;
+        lamp_ct = 0;
+        rampTo(ramp_lamp_red, (v>>16) & 0xFF, transitionMs);
+        rampTo(ramp_lamp_green, (v>>8) & 0xFF, transitionMs);
+        rampTo(ramp_lamp_blue, v & 0xFF, transitionMs);
+        rampTo(ramp_brightness, 0xFF, transitionMs);
       }
       else {
         // colored modes, only set overall brightness
-        brightness = v & 0xFF;
+        rampTo(ramp_brightness, v & 0xFF, transitionMs);
       }
     }
     else {
-      if (mode==mode_lamp) {
-        // RGB Lamp
-        return
-          (mode<<24) |
-          (lamp_red<<16) |
-          (lamp_green<<8) |
-          lamp_blue;
-      }
-      else {
-        // only brightness
-        return
-          (mode<<24) |
-          (brightness & 0xFF);
-      }
+      return vdsdState();
     }
   }
   return 0;
 }
 
+
+// state as returned by the vdsd "state" command
+uint32_t vdsdState()
+{
+  if (mode==mode_lamp) {
+    // RGB Lamp
+    return
+      (mode<<24) |
+      (lamp_red<<16) |
+      (lamp_green<<8) |
+      lamp_blue;
+  }
+  else {
+    // only brightness
+    return
+      (mode<<24) |
+      (brightness & 0xFF);
+  }
+}
+
+
+// publish a "vdsd_state" event ("state=n,brightness=n,ct=n", same values as the vdsd commands return)
+// when state, brightness or color temperature have changed, no matter where the change came from.
+// Changes within statePublishIntervalMs are coalesced into one event showing the latest values.
+// Called from the application thread. It only reads the parameters, so a change made by the
+// render thread while reading is at worst published with the next event.
+void checkStatePublish()
+{
+  uint32_t state = vdsdState();
+  int bri = brightness;
+  int ct = lamp_ct;
+  if (state==publishedState && bri==publishedBrightness && ct==publishedCt) return; // no change
+  if (millis()-lastStatePublishMs<statePublishIntervalMs) return; // too early, publish later
+  if (!Spark.connected()) return; // publish when connected
+  char event[48];
+  snprintf(event, sizeof(event), "state=%lu,brightness=%d,ct=%d", (unsigned long)state, bri, ct);
+  if (Spark.publish("vdsd_state", event, 60, PRIVATE)) {
+    publishedState = state;
+    publishedBrightness = bri;
+    publishedCt = ct;
+  }
+  lastStatePublishMs = millis();
+}
+
 #endif
 
 
 // text layer
 // ==========
 
-// text layer, but only one strip around the tube (ledsPerLevel) with the height of the characters (rowsPerGlyph)
-const int textPixels = ledsPerLevel*rowsPerGlyph;
-byte textLayer[textPixels];
+typedef enum {
+  text_horizontal = 0, // single line scrolling around the tube at text_base_line
+  text_vertical = 1, // word wrapped lines, scrolling up the tube
+  text_rotated = 2, // single line rotated by 90 degrees, running down the tube
+} TextLayout;
+
+const int lineSpacing = 2; // empty rows between lines in text_vertical layout
+const int maxMessageChars = 224; // longest message (decoded), fits into textBitmap at text_scale 100 even with the widest glyphs
+
+// text layer, intensity of text for every LED
+byte textLayer[numLeds];
 String text;
 
-int textPixelOffset;
-int textCycleCount;
+// the message is rasterized once into a bitmap, rows of textStride bytes, bit 0 of byte 0 is leftmost
+const int textBitmapBytes = 2048;
+byte textBitmap[textBitmapBytes];
+int textStride; // bytes per bitmap row
+int textRows; // number of bitmap rows (row 0 is bottom)
+int textWidth; // width of the rasterized message in pixels
+int textGlyphRows; // height of the (scaled) glyphs in the bitmap
+
+int32_t textPos; // scroll position in 1/256 pixels
+uint32_t textPosRem; // remainder of time based scrolling, in 1/256 pixels * mS
+uint32_t lastTextMs; // time of last text scroll step
 int repeatCount;
 
 
 // this function automagically gets called upon a matching POST request
 int newMessage(String aText)
+{
+  return showMessage(aText, true);
+}
+
+
+// show a message
+// @param aText URL encoded text
+// @param aRemember if set, message is stored in the history
+// @return 1 if ok, -4 if the message is longer than maxMessageChars (and is not shown)
+int showMessage(String aText, bool aRemember)
 {
   // URL decode
-  text = "";
+  String decoded;
   int i = 0;
   char c;
   while (i<(int)aText.length()) {
@@ -927,169 +1580,960 @@ int newMessage(String aText)
       c = aText[i];
     }
     // put to output string
-    text += String(c);
+    decoded += String(c);
     i++;
   }
-  // initiate display of new text
-  textPixelOffset = -ledsPerLevel;
-  textCycleCount = 0;
-  repeatCount = 0;
+  if ((int)decoded.length()>maxMessageChars) return -4;
+  text = decoded;
+  if (aRemember) addToHistory(text);
+  startText();
   return 1;
 }
 
 
-void resetText()
+// initiate display of new text
+void startText()
 {
-  for(int i=0; i<textPixels; i++) {
-    textLayer[i] = 0;
-  }
+  restartText();
+  repeatCount = 0;
+  needsRefresh = true;
 }
 
 
-void crossFade(byte aFader, byte aValue, byte &aOutputA, byte &aOutputB)
-{
-  byte baseBrightness = (aValue*fade_base)>>8;
-  byte varBrightness = aValue-baseBrightness;
-  byte fade = (varBrightness*aFader)>>8;
-  aOutputB = baseBrightness+fade;
-  aOutputA = baseBrightness+(varBrightness-fade);
-}
+// chunked upload of messages too long for a single cloud function call
+// ---------------------------------------------------------------------
 
+const int maxChunkedMessage = 3*maxMessageChars; // max length of reassembled message (still URL encoded, up to 3 chars per char)
+const uint32_t chunkTimeoutMs = 10000; // max time between chunks of the same message
 
-int glyphIndexForChar(const char aChar)
-{
-  int i = aChar-0x20;
-  if (i<0 || i>=numGlyphs) i = 95; // ASCII 0x7F-0x20
-  return i;
-}
+char chunkBuffer[maxChunkedMessage+1]; // fixed reassembly buffer, no heap use while receiving
+int chunkLen = 0; // number of chars in chunkBuffer
+int chunkId = -1; // id of message being received, -1 if none
+int chunkSeq = 0; // next expected sequence number
+bool chunkDone = false; // set when final chunk has been received
+uint32_t lastChunkMs = 0; // when last chunk was received
 
 
-void renderText()
+// this function automagically gets called upon a matching POST request
+// Argument is "id,seq,final,payload":
+// - id: number chosen by the sender, identifies the message
+// - seq: 0 for the first chunk, +1 for every following chunk
+// - final: 1 for the last chunk, which displays the message, 0 otherwise
+// - payload: next part of the (URL encoded) message
+// Returns number of chars received so far (>0), or
+// -1 for a chunk out of sequence, -2 when the previous chunk is too long ago, -3 when message gets too long,
+// -4 when the final message decodes to more than maxMessageChars.
+// Repeating the last chunk (e.g. because the response got lost) is ok.
+int messageChunk(String aChunk)
 {
-  // fade between rows
-  byte maxBright = text_intensity-repeatCount*fade_per_repeat;
-  byte thisBright, nextBright;
-  crossFade(255*textCycleCount/cycles_per_px, maxBright, thisBright, nextBright);
-  // generate vertical rows
-  int activeCols = ledsPerLevel-2;
-  // calculate text length in pixels
-  int totalTextPixels = 0;
-  int textLen = (int)text.length();
-  for (int i=0; i<textLen; i++) {
-    // sum up width of individual chars
-    totalTextPixels += fontGlyphs[glyphIndexForChar(text[i])].width + glyphSpacing;
-  }
-  for (int x=0; x<ledsPerLevel; x++) {
-    uint8_t column = 0;
-    // determine font column
-    if (x<activeCols) {
-      int colPixelOffset = textPixelOffset + x;
-      if (colPixelOffset>=0) {
-        // visible column
-        // - calculate character index
-        int charIndex = 0;
-        int glyphOffset = colPixelOffset;
-        const glyph_t *glyphP = NULL;
-        while (charIndex<textLen) {
-          glyphP = &fontGlyphs[glyphIndexForChar(text[charIndex])];
-          int cw = glyphP->width + glyphSpacing;
-          if (glyphOffset<cw) break; // found char
-          glyphOffset -= cw;
-          charIndex++;
-        }
-        // now we have
-        // - glyphP = the glyph,
-        // - glyphOffset=column offset within that glyph (but might address a spacing column not stored in font table)
-        if (charIndex<textLen) {
-          // is a column of a visible char
-          if (glyphOffset<glyphP->width) {
-            // fetch glyph column
-            column = glyphP->cols[glyphOffset];
-          }
-        }
-      }
-    }
-    // now render columns
-    for (int glyphRow=0; glyphRow<rowsPerGlyph; glyphRow++) {
-      int i;
-      int leftstep;
-      if (mirrorText) {
-        i = (glyphRow+1)*ledsPerLevel - 1 - x; // LED index, x-direction mirrored
-        leftstep = 1;
-      }
-      else {
-        i = glyphRow*ledsPerLevel + x; // LED index
-        leftstep = -1;
-      }
-      if (glyphRow < rowsPerGlyph) {
-        if (column & (0x40>>glyphRow)) {
-          textLayer[i] = thisBright;
-          // also adjust pixel left to this one
-          if (x>0) {
-            increase(textLayer[i+leftstep], nextBright, maxBright);
-          }
-          continue;
-        }
-      }
-      textLayer[i] = 0; // no text
-    }
-  }
-  // increment
-  textCycleCount++;
-  if (textCycleCount>=cycles_per_px) {
-    textCycleCount = 0;
-    textPixelOffset++;
-    if (textPixelOffset>totalTextPixels) {
-      // text shown, check for repeats
-      repeatCount++;
-      if (text_repeats!=0 && repeatCount>=text_repeats) {
-        // done
-        text = ""; // remove text
-      }
-      else {
-        // show again
-        textPixelOffset = -ledsPerLevel;
-        textCycleCount = 0;
-      }
+  int i = aChunk.indexOf(',');
+  int j = i<0 ? -1 : aChunk.indexOf(',', i+1);
+  int k = j<0 ? -1 : aChunk.indexOf(',', j+1);
+  if (k<0) return -1;
+  int id = aChunk.substring(0,i).toInt();
+  int seq = aChunk.substring(i+1,j).toInt();
+  bool isFinal = aChunk.substring(j+1,k).toInt()!=0;
+  uint32_t now = millis();
+  if (seq==0) {
+    // new message, abandons any incomplete one
+    chunkId = id;
+    chunkSeq = 0;
+    chunkLen = 0;
+    chunkDone = false;
+  }
+  else {
+    if (id!=chunkId) return -1;
+    if (now-lastChunkMs>chunkTimeoutMs) {
+      chunkId = -1;
+      return -2;
     }
+    if (seq==chunkSeq-1) return chunkLen; // repeated chunk, already have it
+    if (seq!=chunkSeq || chunkDone) return -1;
   }
+  lastChunkMs = now;
+  int n = aChunk.length()-(k+1);
+  if (chunkLen+n>maxChunkedMessage) {
+    chunkId = -1;
+    return -3;
+  }
+  for (int c=0; c<n; c++) chunkBuffer[chunkLen++] = aChunk[k+1+c];
+  chunkSeq++;
+  if (isFinal) {
+    chunkBuffer[chunkLen] = 0;
+    chunkDone = true;
+    int res = newMessage(chunkBuffer);
+    if (res<0) return res;
+  }
+  return chunkLen>0 ? chunkLen : 1;
 }
 
 
+// message history
+// ---------------
 
-// torch mode
-// ==========
-
-byte currentEnergy[numLeds]; // current energy level
-byte nextEnergy[numLeds]; // next energy level
-byte energyMode[numLeds]; // mode how energy is calculated for this point
+// EEPROM layout
+const int eepromSettingsSize = 160; // space reserved for one Settings record
+const int eepromSettingsAddr = 0; // Settings, restored at startup
+const int numScenes = 6; // number of scenes that can be stored
+const int eepromScenesAddr = eepromSettingsAddr+eepromSettingsSize; // scenes (Settings records)
+const int eepromHistoryAddr = eepromScenesAddr+numScenes*eepromSettingsSize; // message history from here to end of EEPROM
 
-enum {
-  torch_passive = 0, // just environment, glow from nearby radiation
-  torch_nop = 1, // no processing
-  torch_spark = 2, // slowly looses energy, moves up
-  torch_spark_temp = 3, // a spark still getting energy from the level below
-};
+// Messages are stored (already decoded) in a ring of slots at the end of the EEPROM (but not below eepromHistoryAddr).
+// New messages always go to the slots following the newest message, so all slots wear equally.
+const int historySlotChars = 28; // chars per slot
+const int maxHistorySlots = 32; // slots used if EEPROM is large enough
+const int maxHistoryParts = (maxMessageChars+historySlotChars-1)/historySlotChars; // enough for the longest message
+const uint8_t historyLastPart = 0x80; // flag in HistorySlot.part for the last part of a message
 
+typedef struct {
+  uint16_t seq; // message sequence number
+  uint8_t part; // part number within message, historyLastPart flag set in the last part
+  uint8_t len; // number of chars in this slot, 0 or >historySlotChars for empty slots
+  char chars[historySlotChars];
+} HistorySlot;
+
+int historySlots = 0; // number of slots available
+int historyStart = 0; // EEPROM address of first slot
+bool historyEmpty = true; // no message in history
+uint16_t historyNewest = 0; // sequence number of newest message
+int historyNextSlot = 0; // slot for the next message
+
+const int messageQueueSize = 8;
+uint16_t messageQueue[messageQueueSize]; // sequence numbers of history messages waiting to be shown
+int messageQueueLen = 0;
+uint32_t lastTextEndMs = 0; // when the last message has finished showing
+int idleAge = 0; // age of next message to show in idle rotation
+
+
+// find newest message in EEPROM
+void beginHistory()
+{
+  historySlots = (EEPROM.length()-eepromHistoryAddr)/sizeof(HistorySlot);
+  if (historySlots<0) historySlots = 0;
+  if (historySlots>maxHistorySlots) historySlots = maxHistorySlots;
+  historyStart = EEPROM.length()-historySlots*sizeof(HistorySlot);
+  historyEmpty = true;
+  historyNextSlot = 0;
+  int newestPart = 0;
+  HistorySlot slot;
+  for (int i=0; i<historySlots; i++) {
+    EEPROM.get(historyStart+i*sizeof(HistorySlot), slot);
+    if (slot.len==0 || slot.len>historySlotChars) continue; // empty
+    int part = slot.part & ~historyLastPart;
+    int16_t d = slot.seq-historyNewest;
+    if (historyEmpty || d>0 || (d==0 && part>newestPart)) {
+      historyEmpty = false;
+      historyNewest = slot.seq;
+      newestPart = part;
+      historyNextSlot = (i+1)%historySlots;
+    }
+  }
+}
 
 
-void resetEnergy()
+void addToHistory(const String &aText)
 {
-  for (int i=0; i<numLeds; i++) {
-    currentEnergy[i] = 0;
-    nextEnergy[i] = 0;
-    energyMode[i] = torch_passive;
+  int n = aText.length();
+  if (historySlots==0 || n==0) return;
+  if (n>maxHistoryParts*historySlotChars) n = maxHistoryParts*historySlotChars;
+  if (!historyEmpty) historyNewest++;
+  historyEmpty = false;
+  HistorySlot slot;
+  slot.seq = historyNewest;
+  for (int part=0, i=0; i<n; part++) {
+    slot.part = part;
+    slot.len = n-i>historySlotChars ? historySlotChars : n-i;
+    if (i+slot.len>=n) slot.part |= historyLastPart;
+    memset(slot.chars, 0, historySlotChars);
+    for (int c=0; c<slot.len; c++) slot.chars[c] = aText[i++];
+    EEPROM.put(historyStart+historyNextSlot*sizeof(HistorySlot), slot);
+    historyNextSlot = (historyNextSlot+1)%historySlots;
   }
 }
 
 
+// get a message from history
+// @param aSeq sequence number of the message
+// @param aBuf buffer for maxHistoryParts*historySlotChars+1 chars
+// @return false if message is not (or not completely any more) in the history
+bool getFromHistory(uint16_t aSeq, char *aBuf)
+{
+  if (historyEmpty || (int16_t)(historyNewest-aSeq)<0) return false;
+  uint8_t found = 0; // bit mask of parts found
+  int lastPart = -1;
+  int len = 0;
+  HistorySlot slot;
+  for (int i=0; i<historySlots; i++) {
+    EEPROM.get(historyStart+i*sizeof(HistorySlot), slot);
+    if (slot.seq!=aSeq || slot.len==0 || slot.len>historySlotChars) continue;
+    int part = slot.part & ~historyLastPart;
+    if (part>=maxHistoryParts) continue;
+    memcpy(aBuf+part*historySlotChars, slot.chars, slot.len);
+    found |= 1<<part;
+    if (slot.part & historyLastPart) {
+      lastPart = part;
+      len = part*historySlotChars+slot.len;
+    }
+  }
+  if (lastPart<0 || found!=(1<<(lastPart+1))-1) return false; // incomplete
+  aBuf[len] = 0;
+  return true;
+}
 
 
-void calcNextEnergy()
+// queue the last aCount messages from history for showing again, oldest first
+void replayHistory(int aCount)
 {
+  messageQueueLen = 0;
+  if (historyEmpty) return;
+  if (aCount>messageQueueSize) aCount = messageQueueSize;
+  for (int age=aCount-1; age>=0; age--) {
+    messageQueue[messageQueueLen++] = historyNewest-age;
+  }
+}
+
+
+void clearHistory()
+{
+  for (int a=historyStart; a<historyStart+historySlots*(int)sizeof(HistorySlot); a++) {
+    EEPROM.write(a, 0);
+  }
+  historyEmpty = true;
+  historyNextSlot = 0;
+  messageQueueLen = 0;
+}
+
+
+// show queued messages, or messages from history when idle
+void checkMessageQueue()
+{
+  if (text.length()>0) return; // still showing a message
+  char buf[maxHistoryParts*historySlotChars+1];
+  while (messageQueueLen>0) {
+    uint16_t seq = messageQueue[0];
+    messageQueueLen--;
+    memmove(messageQueue, messageQueue+1, messageQueueLen*sizeof(uint16_t));
+    if (getFromHistory(seq, buf)) {
+      text = buf;
+      startText();
+      return;
+    }
+  }
+  if (history_idle>0 && !historyEmpty && millis()-lastTextEndMs>(uint32_t)history_idle*1000) {
+    // rotate through history, newest first
+    if (!getFromHistory(historyNewest-idleAge, buf)) {
+      // reached oldest message, start over
+      idleAge = 0;
+      if (!getFromHistory(historyNewest, buf)) {
+        lastTextEndMs = millis(); // nothing to show, try again later
+        return;
+      }
+    }
+    idleAge++;
+    text = buf;
+    startText();
+  }
+}
+
+
+void resetText()
+{
+  memset(textLayer, 0, sizeof(textLayer));
+}
+
+
+void crossFade(byte aFader, byte aValue, byte &aOutputA, byte &aOutputB)
+{
+  byte baseBrightness = (aValue*fade_base)>>8;
+  byte varBrightness = aValue-baseBrightness;
+  byte fade = (varBrightness*aFader)>>8;
+  aOutputB = baseBrightness+fade;
+  aOutputA = baseBrightness+(varBrightness-fade);
+}
+
+
+int glyphIndexForChar(const char aChar)
+{
+  int i = aChar-0x20;
+  if (i<0 || i>=numGlyphs) i = 95; // ASCII 0x7F-0x20
+  return i;
+}
+
+
+inline void setTextBit(int aX, int aY)
+{
+  textBitmap[aY*textStride+(aX>>3)] |= 1<<(aX&7);
+}
+
+
+inline bool getTextBit(int aX, int aY)
+{
+  if (aX<0 || aX>=textWidth || aY<0 || aY>=textRows) return false;
+  return textBitmap[aY*textStride+(aX>>3)] & (1<<(aX&7));
+}
+
+
+// @return 32 bits of a bitmap row, bit 0 is column aX
+uint32_t getTextBits(int aX, int aY)
+{
+  if (aY<0 || aY>=textRows || aX>=textWidth || aX<=-32) return 0;
+  if (aX<0) return getTextBits(0, aY)<<(-aX);
+  const byte *rowP = &textBitmap[aY*textStride];
+  int b = aX>>3;
+  uint64_t w = 0;
+  for (int k=4; k>=0; k--) {
+    w <<= 8;
+    if (b+k<textStride) w |= rowP[b+k];
+  }
+  return (uint32_t)(w>>(aX&7));
+}
+
+
+// font pixels scaled by text_scale
+int scaledSize(int aPixels)
+{
+  int s = (aPixels*text_scale+50)/100;
+  return s<1 ? 1 : s;
+}
+
+
+// @return width of a char in the bitmap, including spacing
+int charWidth(char aChar)
+{
+  return scaledSize(fontGlyphs[glyphIndexForChar(aChar)].width) + scaledSize(glyphSpacing);
+}
+
+
+// @return 1 if font pixel is set, 0 otherwise (also outside glyph)
+inline int glyphBit(int aGlyphIndex, int aCol, int aRow)
+{
+  const glyph_t &g = fontGlyphs[aGlyphIndex];
+  if (aCol<0 || aCol>=g.width || aRow<0 || aRow>=rowsPerGlyph) return 0;
+  return (g.cols[aCol]>>(rowsPerGlyph-1-aRow)) & 1;
+}
+
+
+// @return pixel of the glyph scaled up 2x with the Scale2x (EPX) rule, which fills in
+//   diagonal steps instead of just repeating pixels
+// @param aX2 column in double resolution
+// @param aY2 row in double resolution
+int glyphBit2x(int aGlyphIndex, int aX2, int aY2)
+{
+  int x = aX2>>1, y = aY2>>1;
+  int dx = aX2&1 ? 1 : -1; // direction towards the quadrant of the font pixel we are in
+  int dy = aY2&1 ? 1 : -1;
+  int h = glyphBit(aGlyphIndex, x+dx, y); // neighbours on the side of the quadrant
+  int v = glyphBit(aGlyphIndex, x, y+dy);
+  if (h==v && v!=glyphBit(aGlyphIndex, x-dx, y) && h!=glyphBit(aGlyphIndex, x, y-dy)) return h;
+  return glyphBit(aGlyphIndex, x, y);
+}
+
+
+// draw a glyph into the bitmap, scaled by text_scale
+// @param aX leftmost column
+// @param aRow bottom row
+// @return width of the glyph including spacing
+int drawGlyph(char aChar, int aX, int aRow)
+{
+  int gi = glyphIndexForChar(aChar);
+  const glyph_t *glyphP = &fontGlyphs[gi];
+  int w = scaledSize(glyphP->width);
+  for (int c=0; c<w && aX+c<textWidth; c++) {
+    for (int glyphRow=0; glyphRow<textGlyphRows; glyphRow++) {
+      bool on;
+      if (text_smooth) {
+        // nearest in the smoothed double resolution glyph
+        on = glyphBit2x(gi, c*2*glyphP->width/w, glyphRow*2*rowsPerGlyph/textGlyphRows);
+      }
+      else {
+        // nearest
+        on = glyphBit(gi, c*glyphP->width/w, glyphRow*rowsPerGlyph/textGlyphRows);
+      }
+      if (on) setTextBit(aX+c, aRow+glyphRow);
+    }
+  }
+  return w + scaledSize(glyphSpacing);
+}
+
+
+// word wrap text into lines of max aLineWidth pixels
+// @param aDraw if set, lines are drawn (centered) into the bitmap, starting at the top
+// @return number of lines
+int wrapText(int aLineWidth, bool aDraw)
+{
+  int textLen = (int)text.length();
+  int lines = 0;
   int i = 0;
-  for (int y=0; y<levels; y++) {
-    for (int x=0; x<ledsPerLevel; x++) {
+  while (i<textLen) {
+    // no spaces at beginning of line
+    while (i<textLen && text[i]==' ') i++;
+    if (i>=textLen) break;
+    // collect chars as long as they fit, remember last word end
+    int w = 0;
+    int j = i;
+    int lineEnd = i;
+    int lineW = 0;
+    while (j<textLen) {
+      int cw = scaledSize(fontGlyphs[glyphIndexForChar(text[j])].width);
+      if (w+cw>aLineWidth) break;
+      w += cw;
+      j++;
+      if (j>=textLen || text[j]==' ') { lineEnd = j; lineW = w; }
+      w += scaledSize(glyphSpacing);
+    }
+    if (lineEnd==i) {
+      // word does not fit into a line, break it (but take at least one char)
+      if (j==i) { j = i+1; w = charWidth(text[i]); }
+      lineEnd = j;
+      lineW = w-scaledSize(glyphSpacing);
+    }
+    if (aDraw) {
+      int row = textRows-lines*(textGlyphRows+lineSpacing)-textGlyphRows;
+      if (row<0) break; // bitmap full
+      int x = lineW<aLineWidth ? (aLineWidth-lineW)/2 : 0;
+      for (int k=i; k<lineEnd; k++) {
+        x += drawGlyph(text[k], x, row);
+      }
+    }
+    lines++;
+    i = lineEnd;
+  }
+  return lines;
+}
+
+
+// render text into the bitmap (once per message, so renderText() does not need to care about glyphs)
+void rasterizeText()
+{
+  int textLen = (int)text.length();
+  textGlyphRows = scaledSize(rowsPerGlyph);
+  if (text_layout==text_vertical) {
+    // lines of the width of the tube, first line at the top
+    textWidth = ledsPerLevel-2;
+    textStride = (textWidth+7)>>3;
+    int lines = wrapText(textWidth, false);
+    textRows = lines*(textGlyphRows+lineSpacing);
+    if (textRows>textBitmapBytes/textStride) textRows = textBitmapBytes/textStride;
+    memset(textBitmap, 0, textStride*textRows);
+    wrapText(textWidth, true);
+    if (textLen==0) textWidth = 0;
+    return;
+  }
+  // single line
+  textRows = textGlyphRows;
+  // calculate text length in pixels
+  textWidth = 0;
+  for (int i=0; i<textLen; i++) {
+    // sum up width of individual chars
+    textWidth += charWidth(text[i]);
+  }
+  // cut what does not fit
+  if (textWidth>textBitmapBytes/textRows*8) textWidth = textBitmapBytes/textRows*8;
+  textStride = (textWidth+7)>>3;
+  memset(textBitmap, 0, textStride*textRows);
+  int x = 0;
+  for (int i=0; i<textLen && x<textWidth; i++) {
+    x += drawGlyph(text[i], x, 0);
+  }
+}
+
+
+// rasterize text and start scrolling it in
+void restartText()
+{
+  rasterizeText();
+  textPos = textStartPos();
+  textPosRem = 0;
+  lastTextMs = millis();
+}
+
+
+// scroll position where text is just outside the display
+int32_t textStartPos()
+{
+  switch (text_layout) {
+    case text_vertical: return -textRows*256;
+    case text_rotated: return -levels*256;
+    default: return -ledsPerLevel*256;
+  }
+}
+
+
+// true when text has scrolled completely out of the display
+bool textDone()
+{
+  if (textWidth==0) return false;
+  int p = textPos>>8;
+  if (text_layout==text_vertical) return p>levels;
+  return p>textWidth;
+}
+
+
+inline void setTextPixel(byte *aLayer, int aX, int aY, byte aValue)
+{
+  if (aX<0 || aX>=ledsPerLevel || aY<0 || aY>=levels) return;
+  if (mirrorText) aX = ledsPerLevel-1-aX; // x-direction mirrored
+  aLayer[aY*ledsPerLevel+aX] = aValue;
+}
+
+
+// render visible part of the text bitmap into aLayer (which must be cleared before), pixel by pixel
+// Note: this is the straightforward version, used for the rotated layout, and as reference
+//   for renderTextWords()
+void renderTextBitwise(byte *aLayer)
+{
+  // fade between columns
+  byte maxBright = text_intensity-repeatCount*fade_per_repeat;
+  byte thisBright, nextBright;
+  crossFade(textPos & 0xFF, maxBright, thisBright, nextBright);
+  // coverage: this pixel moving out, the next one moving in
+  // (with fade_base=0, this is exact linear coverage, higher values keep moving text brighter)
+  int p = textPos>>8;
+  switch (text_layout) {
+    case text_vertical: {
+      // bitmap rows move up
+      for (int y=0; y<levels; y++) {
+        int v = y-p;
+        for (int x=0; x<textWidth; x++) {
+          byte b = 0;
+          if (getTextBit(x, v)) b = thisBright;
+          if (getTextBit(x, v-1)) increase(b, nextBright, maxBright);
+          setTextPixel(aLayer, x, y, b);
+        }
+      }
+      break;
+    }
+    case text_rotated: {
+      // bitmap columns move down the tube, bitmap rows go around the tube
+      int x0 = (ledsPerLevel-textRows)/2;
+      for (int y=0; y<levels; y++) {
+        int u = p+(levels-1-y);
+        for (int glyphRow=0; glyphRow<textRows; glyphRow++) {
+          byte b = 0;
+          if (getTextBit(u, glyphRow)) b = thisBright;
+          if (getTextBit(u+1, glyphRow)) increase(b, nextBright, maxBright);
+          setTextPixel(aLayer, x0+glyphRow, y, b);
+        }
+      }
+      break;
+    }
+    default: {
+      // bitmap columns move around the tube
+      int activeCols = ledsPerLevel-2;
+      for (int x=0; x<activeCols; x++) {
+        int u = p+x;
+        for (int glyphRow=0; glyphRow<textRows; glyphRow++) {
+          byte b = 0;
+          if (getTextBit(u, glyphRow)) b = thisBright;
+          if (x+1<activeCols && getTextBit(u+1, glyphRow)) increase(b, nextBright, maxBright);
+          setTextPixel(aLayer, x, text_base_line+glyphRow, b);
+        }
+      }
+      break;
+    }
+  }
+}
+
+
+// 4 bits to 4 bytes, 0x00 for 0 bits, 0xFF for 1 bits (bit 0 -> lowest byte)
+static const uint32_t nibbleMask[16] = {
+  0x00000000, 0x000000FF, 0x0000FF00, 0x0000FFFF, 0x00FF0000, 0x00FF00FF, 0x00FFFF00, 0x00FFFFFF,
+  0xFF000000, 0xFF0000FF, 0xFF00FF00, 0xFF00FFFF, 0xFFFF0000, 0xFFFF00FF, 0xFFFFFF00, 0xFFFFFFFF
+};
+
+
+// expand up to 32 pixels of one LED row from two bit planes (this: pixel moving out, next: pixel moving in)
+// into intensities, 4 pixels at a time
+void expandTextBits(byte *aLayer, int aX, int aY, int aCount, uint32_t aThis, uint32_t aNext, uint32_t aThisBright4, uint32_t aNextBright4, uint32_t aBothBright4)
+{
+  if (aY<0 || aY>=levels) return;
+  byte *rowP = &aLayer[aY*ledsPerLevel];
+  for (int x=0; x<aCount && (aThis|aNext); x+=4, aThis>>=4, aNext>>=4) {
+    uint32_t m0 = nibbleMask[aThis & 0xF];
+    uint32_t m1 = nibbleMask[aNext & 0xF];
+    uint32_t v = (m0 & m1 & aBothBright4) | (m0 & ~m1 & aThisBright4) | (~m0 & m1 & aNextBright4);
+    if (v==0) continue; // layer is already cleared
+    if (!mirrorText && x+4<=aCount) {
+      // whole word (little endian, lowest byte is leftmost pixel)
+      memcpy(rowP+aX+x, &v, 4);
+    }
+    else {
+      for (int k=0; k<4 && x+k<aCount; k++, v>>=8) {
+        setTextPixel(aLayer, aX+x+k, aY, v & 0xFF);
+      }
+    }
+  }
+}
+
+
+// render visible part of the text bitmap into aLayer (which must be cleared before),
+// extracting the bitmap rows as 32 bit words and expanding them 4 pixels at a time
+void renderTextWords(byte *aLayer)
+{
+  if (text_layout==text_rotated) {
+    // bitmap columns run along the LED columns, no use for words here
+    renderTextBitwise(aLayer);
+    return;
+  }
+  byte maxBright = text_intensity-repeatCount*fade_per_repeat;
+  byte thisBright, nextBright;
+  crossFade(textPos & 0xFF, maxBright, thisBright, nextBright);
+  byte bothBright = thisBright;
+  increase(bothBright, nextBright, maxBright);
+  uint32_t this4 = thisBright*0x01010101u;
+  uint32_t next4 = nextBright*0x01010101u;
+  uint32_t both4 = bothBright*0x01010101u;
+  int p = textPos>>8;
+  if (text_layout==text_vertical) {
+    // bitmap rows move up
+    for (int y=0; y<levels; y++) {
+      int v = y-p;
+      if (v<0 || v>textRows) continue;
+      for (int x=0; x<textWidth; x+=32) {
+        int n = textWidth-x<32 ? textWidth-x : 32;
+        expandTextBits(aLayer, x, y, n, getTextBits(x, v), getTextBits(x, v-1), this4, next4, both4);
+      }
+    }
+  }
+  else {
+    // bitmap columns move around the tube
+    int activeCols = ledsPerLevel-2;
+    for (int glyphRow=0; glyphRow<textRows; glyphRow++) {
+      for (int x=0; x<activeCols; x+=32) {
+        int n = activeCols-x<32 ? activeCols-x : 32;
+        uint32_t thisBits = getTextBits(p+x, glyphRow);
+        uint32_t nextBits = getTextBits(p+x+1, glyphRow);
+        if (x+n>=activeCols) nextBits &= ~(1ul<<(n-1)); // last column has no next column
+        if (n<32) {
+          thisBits &= (1ul<<n)-1;
+          nextBits &= (1ul<<n)-1;
+        }
+        expandTextBits(aLayer, x, text_base_line+glyphRow, n, thisBits, nextBits, this4, next4, both4);
+      }
+    }
+  }
+}
+
+
+#if SELFTEST
+uint16_t selftestErrors = 0; // number of mismatches between optimized code and reference implementations
+uint32_t selftestChecks = 0; // number of comparisons made
+byte referenceTextLayer[numLeds];
+#endif
+
+void renderText()
+{
+  resetText();
+  if (textWidth>0) {
+    renderTextWords(textLayer);
+    #if SELFTEST
+    memset(referenceTextLayer, 0, sizeof(referenceTextLayer));
+    renderTextBitwise(referenceTextLayer);
+    selftestChecks++;
+    if (memcmp(referenceTextLayer, textLayer, sizeof(textLayer))!=0) selftestErrors++;
+    #endif
+  }
+  // advance
+  uint32_t now = millis();
+  if (text_speed>0) {
+    // time based, same speed at any frame rate
+    uint32_t dt = now-lastTextMs;
+    if (dt>1000) dt = 1000; // don't jump after stalls
+    textPosRem += text_speed*256*dt;
+    textPos += textPosRem/1000;
+    textPosRem %= 1000;
+  }
+  else {
+    textPos += 256/(cycles_per_px>0 ? cycles_per_px : 1);
+  }
+  lastTextMs = now;
+  if (textDone()) {
+    // text shown, check for repeats
+    repeatCount++;
+    if (text_repeats!=0 && repeatCount>=text_repeats) {
+      // done
+      text = ""; // remove text
+      textWidth = 0;
+      lastTextEndMs = millis();
+      needsRefresh = true; // static modes need one more frame to remove the text
+    }
+    else {
+      // show again
+      textPos = textStartPos();
+    }
+  }
+}
+
+
+
+// torch mode
+// ==========
+
+// The energy field is simulated in its own resolution (see sim_scale) and then resampled to the LEDs
+const int maxSimCells = numLeds*maxSimScale*maxSimScale;
+const int minSimScale = -4; // lowest simulation resolution is 1/4 of LED resolution
+
+// the current energy buffer has always-zero guard cells before and after the simulation cells,
+// such that kernel and sparks can access neighbours of all cells without range checks
+const int energyGuard = 2*ledsPerLevel*maxSimScale;
+
+byte currentEnergyBuf[energyGuard+maxSimCells+energyGuard];
+byte * const currentEnergy = currentEnergyBuf+energyGuard; // current energy level
+byte nextEnergy[maxSimCells]; // next energy level (also used for interpolated energy between simulation steps)
+byte prevEnergy[maxSimCells]; // energy level of previous simulation step, for interpolation
+byte energyMode[maxSimCells]; // mode how energy is calculated for this point
+
+// energy propagation kernel as list of non-zero taps
+typedef struct {
+  int16_t offset; // offset of neighbour cell
+  uint16_t weight; // weight in 1/512
+} KernelTap;
+
+KernelTap kernelTaps[kernelRows*kernelCols];
+int numKernelTaps = 0;
+int numBelowTaps = 0; // the first numBelowTaps taps are in the row below, and are subject to wind
+
+int8_t rowShift[levels*maxSimScale]; // wind: horizontal offset of energy coming from the row below, per simulation row
+
+int simScale = 1; // actual simulation scale (sim_scale, possibly reduced by adaptive quality control)
+int simDiv = 1; // actual simulation divider (sim_div, possibly increased by adaptive quality control)
+uint16_t simPerLevel = ledsPerLevel; // number of simulation cells per level
+uint16_t simLevels = levels; // number of simulation levels
+uint16_t simCells = numLeds; // total number of simulation cells
+uint16_t injectRows = 1; // number of simulation rows getting random flame energy (one LED row)
+uint16_t activeRows = levels; // number of simulation rows from the bottom that have energy or sparks
+uint16_t prevActiveRows = levels; // activeRows of previous simulation step
+int simPhase = 0; // number of frames since last simulation step
+
+// resampling from simulation to LED resolution
+uint32_t boxNorm; // for supersampling: 65536/(number of cells averaged per LED)
+uint8_t resampleX0[ledsPerLevel]; // for downsampling: bilinear interpolation positions and fractions (0..255) per LED column...
+uint8_t resampleX1[ledsPerLevel];
+uint8_t resampleFX[ledsPerLevel];
+uint8_t resampleY0[levels]; // ...and per LED row
+uint8_t resampleY1[levels];
+uint8_t resampleFY[levels];
+
+enum {
+  torch_passive = 0, // just environment, glow from nearby radiation
+  torch_nop = 1, // no processing
+  torch_spark = 2, // slowly looses energy, moves up
+  torch_spark_temp = 3, // a spark still getting energy from the level below
+};
+
+
+
+void resetEnergy()
+{
+  memset(currentEnergyBuf, 0, sizeof(currentEnergyBuf));
+  for (int i=0; i<maxSimCells; i++) {
+    nextEnergy[i] = 0;
+    prevEnergy[i] = 0;
+    energyMode[i] = torch_passive;
+  }
+}
+
+
+
+// calculate bilinear sampling positions for downsampling by aDiv
+static void calcResamplePositions(int aDiv, int aSimSize, int aLedSize, uint8_t *aP0, uint8_t *aP1, uint8_t *aF)
+{
+  for (int l=0; l<aLedSize; l++) {
+    // center of LED in simulation coordinates, 8 bit fraction
+    int sp = (((2*l+1)<<8)/(2*aDiv)) - 128;
+    if (sp<0) sp = 0;
+    aP0[l] = sp>>8;
+    aF[l] = sp & 0xFF;
+    aP1[l] = aP0[l]+1<aSimSize ? aP0[l]+1 : aSimSize-1;
+  }
+}
+
+
+// bring energy field from aOldPerLevel*aOldLevels cells to current simulation resolution,
+// so the flames continue instead of starting over
+void resampleEnergy(int aOldPerLevel, int aOldLevels)
+{
+  byte *old = nextEnergy; // scratch, recalculated in next simulation step anyway
+  memcpy(old, currentEnergy, aOldPerLevel*aOldLevels);
+  int i = 0;
+  for (int y=0; y<simLevels; y++) {
+    const byte *oldRow = &old[(y*aOldLevels/simLevels)*aOldPerLevel];
+    for (int x=0; x<simPerLevel; x++) {
+      currentEnergy[i++] = oldRow[x*aOldPerLevel/simPerLevel];
+    }
+  }
+  // cells outside the field must be zero, neighbours of the top row
+  memset(currentEnergy+simCells, 0, maxSimCells-simCells);
+  memcpy(prevEnergy, currentEnergy, simCells);
+  memset(nextEnergy, 0, maxSimCells);
+  // sparks do not survive scaling, their energy remains as glow
+  memset(energyMode, torch_passive, maxSimCells);
+}
+
+
+// normalize simulation scale to what setSimResolution() supports
+int validSimScale(int aScale)
+{
+  if (aScale>maxSimScale) aScale = maxSimScale;
+  if (aScale<minSimScale) aScale = minSimScale;
+  if (aScale>-2 && aScale<2) aScale = 1;
+  return aScale;
+}
+
+
+void setSimResolution(int aScale)
+{
+  int oldPerLevel = simPerLevel;
+  int oldLevels = simLevels;
+  simScale = validSimScale(aScale);
+  if (simScale>1) {
+    // supersampling
+    simPerLevel = ledsPerLevel*simScale;
+    simLevels = levels*simScale;
+    injectRows = simScale;
+    boxNorm = 65536/(simScale*simScale);
+  }
+  else if (simScale<-1) {
+    // downsampling
+    int div = -simScale;
+    simPerLevel = (ledsPerLevel+div-1)/div;
+    simLevels = (levels+div-1)/div;
+    injectRows = 1;
+    calcResamplePositions(div, simPerLevel, ledsPerLevel, resampleX0, resampleX1, resampleFX);
+    calcResamplePositions(div, simLevels, levels, resampleY0, resampleY1, resampleFY);
+  }
+  else {
+    // native resolution
+    simPerLevel = ledsPerLevel;
+    simLevels = levels;
+    injectRows = 1;
+  }
+  simCells = simPerLevel*simLevels;
+  activeRows = simLevels;
+  prevActiveRows = simLevels;
+  simPhase = 0;
+  kernelValid = false;
+  resampleEnergy(oldPerLevel, oldLevels);
+}
+
+
+// set kernel from up_rad, side_rad and diag_rad
+void setRadiationKernel()
+{
+  memset(kernel, 0, sizeof(kernel));
+  kernel[1][1] = side_rad;
+  kernel[1][3] = side_rad;
+  kernel[2][1] = diag_rad;
+  kernel[2][2] = 2*up_rad;
+  kernel[2][3] = diag_rad;
+  kernelValid = false;
+}
+
+
+// set kernel from colon separated list of weights, row by row, starting with the row above.
+// 9 weights set a 3x3 kernel, 15 weights a 5x3 kernel
+void setKernel(String aWeights)
+{
+  uint16_t w[kernelRows*kernelCols];
+  int n = 0;
+  int p = 0;
+  while (p<(int)aWeights.length() && n<kernelRows*kernelCols) {
+    int i = aWeights.indexOf(':',p);
+    if (i<0) i = aWeights.length();
+    w[n++] = aWeights.substring(p,i).toInt();
+    p = i+1;
+  }
+  if (n!=9 && n!=15) return; // invalid
+  int cols = n/kernelRows;
+  memset(kernel, 0, sizeof(kernel));
+  for (int ky=0; ky<kernelRows; ky++) {
+    for (int kx=0; kx<cols; kx++) {
+      kernel[ky][kx+(kernelCols-cols)/2] = w[ky*cols+kx];
+    }
+  }
+  kernelValid = false;
+}
+
+
+// build tap list from kernel for current simulation resolution
+void calcKernelTaps()
+{
+  numKernelTaps = 0;
+  // row below first
+  for (int ky=kernelRows-1; ky>=0; ky--) {
+    for (int kx=0; kx<kernelCols; kx++) {
+      if (kernel[ky][kx]) {
+        kernelTaps[numKernelTaps].offset = (1-ky)*simPerLevel + kx-kernelCols/2;
+        kernelTaps[numKernelTaps].weight = kernel[ky][kx];
+        numKernelTaps++;
+      }
+    }
+    if (ky==kernelRows-1) numBelowTaps = numKernelTaps;
+  }
+  kernelValid = true;
+}
+
+
+// calculate per row horizontal shifts from wind, gusts and swirl
+void calcRowShifts()
+{
+  if (wind==0 && wind_gust==0 && wind_swirl==0) {
+    memset(rowShift, 0, sizeof(rowShift));
+    return;
+  }
+  uint32_t t = millis();
+  int w = wind + ((wind_gust*noise(t>>2))>>7); // gusts change about once per second
+  int maxShift = simPerLevel/2; // guard cells cover a shift of up to one row
+  int acc = 0;
+  int shifted = 0;
+  for (int y=0; y<simLevels; y++) {
+    // accumulate fractional shifts, shift row by the whole cells accumulated so far
+    acc += w + ((wind_swirl*noise((y<<6)+(t>>3)))>>7);
+    int sh = (acc>>8)-shifted;
+    if (sh>maxShift) sh = maxShift;
+    else if (sh<-maxShift) sh = -maxShift;
+    shifted += sh; // only what was actually applied, the rest carries over to next row
+    rowShift[y] = sh;
+  }
+}
+
+
+#if SELFTEST
+
+// straightforward reference for what calcNextEnergy() calculates for a passive cell
+byte referencePassiveEnergy(int aX, int aY)
+{
+  uint32_t sum = 0;
+  for (int ky=0; ky<kernelRows; ky++) {
+    for (int kx=0; kx<kernelCols; kx++) {
+      // neighbours wrap around into next/previous row (LED strip is wound around the tube)
+      int ni = (aY+1-ky)*simPerLevel + aX+kx-kernelCols/2;
+      if (ky==kernelRows-1) ni += rowShift[aY]; // row below is shifted by wind
+      if (ni>=0 && ni<simCells) sum += (uint32_t)currentEnergy[ni]*kernel[ky][kx];
+    }
+  }
+  sum >>= 9;
+  sum += ((uint32_t)currentEnergy[aY*simPerLevel+aX]*heat_cap)>>8;
+  return sum>255 ? 255 : sum;
+}
+
+#endif
+
+
+void calcNextEnergy()
+{
+  if (!kernelValid) calcKernelTaps();
+  calcRowShifts();
+  // Energy rises by at most one row per cycle, so rows further up than one above
+  // the highest active row have zero energy and remain that way.
+  int simRows = simLevels;
+  if (track_rows && activeRows<simLevels) simRows = activeRows+1;
+  int newActiveRows = 0;
+  int i = 0;
+  for (int y=0; y<simRows; y++) {
+    byte rowActive = 0;
+    int shift = rowShift[y];
+    for (int x=0; x<simPerLevel; x++) {
       byte e = currentEnergy[i];
       byte m = energyMode[i];
       switch (m) {
@@ -1097,17 +2541,23 @@ void calcNextEnergy()
           // loose transfer up energy as long as the is any
           reduce(e, spark_tfr);
           // cell above is temp spark, sucking up energy from this cell until empty
-          if (y<levels-1) {
-            energyMode[i+ledsPerLevel] = torch_spark_temp;
+          if (y<simLevels-1) {
+            energyMode[i+simPerLevel] = torch_spark_temp;
+          }
+          else if (e==0) {
+            // top row has no cell above to take over, exhausted spark becomes passive
+            // (otherwise it would keep the top row active forever)
+            m = torch_passive;
+            energyMode[i] = m;
           }
           break;
         }
         case torch_spark_temp: {
           // just getting some energy from below
-          byte e2 = currentEnergy[i-ledsPerLevel];
+          byte e2 = currentEnergy[i-simPerLevel];
           if (e2<spark_tfr) {
             // cell below is exhausted, becomes passive
-            energyMode[i-ledsPerLevel] = torch_passive;
+            energyMode[i-simPerLevel] = torch_passive;
             // gobble up rest of energy
             increase(e, e2);
             // loose some overall energy
@@ -1122,69 +2572,320 @@ void calcNextEnergy()
         }
         case torch_passive: {
           e = ((int)e*heat_cap)>>8;
-          increase(e, ((((int)currentEnergy[i-1]+(int)currentEnergy[i+1])*side_rad)>>9) + (((int)currentEnergy[i-ledsPerLevel]*up_rad)>>8));
+          const byte *c = &currentEnergy[i];
+          uint32_t sum = 0;
+          int t = 0;
+          // energy from below, shifted by wind
+          const byte *cb = c+shift;
+          for (; t<numBelowTaps; t++) {
+            sum += (uint32_t)cb[kernelTaps[t].offset]*kernelTaps[t].weight;
+          }
+          for (; t<numKernelTaps; t++) {
+            sum += (uint32_t)c[kernelTaps[t].offset]*kernelTaps[t].weight;
+          }
+          sum >>= 9;
+          increase(e, sum>255 ? 255 : sum);
+          #if SELFTEST
+          selftestChecks++;
+          if (e!=referencePassiveEnergy(x, y)) selftestErrors++;
+          #endif
         }
         default:
           break;
       }
+      rowActive |= e | m; // any energy or non-passive mode makes the row active
       nextEnergy[i++] = e;
     }
+    if (rowActive) newActiveRows = y+1;
   }
+  activeRows = newActiveRows;
+  // next becomes current (rows not simulated are zero in both)
+  memcpy(currentEnergy, nextEnergy, i);
 }
 
 
 const uint8_t energymap[32] = {0, 64, 96, 112, 128, 144, 152, 160, 168, 176, 184, 184, 192, 200, 200, 208, 208, 216, 216, 224, 224, 224, 232, 232, 232, 240, 240, 240, 240, 248, 248, 248};
 
-void calcNextColors()
+// energy to color palette, already scaled by brightness
+// - index 0 is background (no energy)
+// - index 1..32 are energy levels (e>>3)+1
+// - index 33..37 are the blueish extra-bright sparks (energy 251..255, blue follows energy)
+const int sparkEnergy = 251; // lowest energy shown as spark
+const int paletteSize = 33+256-sparkEnergy;
+RGBColor energyPalette[paletteSize];
+
+void calcPalette()
 {
-  int textStart = text_base_line*ledsPerLevel;
-  int textEnd = textStart+rowsPerGlyph*ledsPerLevel;
-  for (int i=0; i<numLeds; i++) {
-    if (i>=textStart && i<textEnd && textLayer[i-textStart]>0) {
-      // overlay with text color
-      leds.setColorDimmed(i, red_text, green_text, blue_text, (brightness*textLayer[i-textStart])>>8);
+  for (int pi=0; pi<paletteSize; pi++) {
+    byte r,g,b;
+    if (pi==0) {
+      // background, no energy
+      r = red_bg; g = green_bg; b = blue_bg;
+    }
+    else if (pi>=33) {
+      // blueish extra-bright spark
+      r = 170; g = 170; b = sparkEnergy+pi-33;
     }
     else {
-      int ei; // index into energy calculation buffer
-      if (upside_down)
-        ei = numLeds-i;
-      else
-        ei = i;
-      uint16_t e = nextEnergy[ei];
-      currentEnergy[ei] = e;
-      if (e>250)
-        leds.setColorDimmed(i, 170, 170, e, brightness); // blueish extra-bright spark
+      // energy to brightness is non-linear
+      byte eb = energymap[pi-1];
+      r = red_bias;
+      g = green_bias;
+      b = blue_bias;
+      increase(r, (eb*red_energy)>>8);
+      increase(g, (eb*green_energy)>>8);
+      increase(b, (eb*blue_energy)>>8);
+    }
+    energyPalette[pi].r = (r*brightness)>>8;
+    energyPalette[pi].g = (g*brightness)>>8;
+    energyPalette[pi].b = (b*brightness)>>8;
+  }
+  paletteValid = true;
+}
+
+
+inline int paletteIndex(byte aEnergy)
+{
+  if (aEnergy==0) return 0;
+  if (aEnergy>=sparkEnergy) return 33+aEnergy-sparkEnergy;
+  return (aEnergy>>3)+1;
+}
+
+
+// get energy for LED at aX,aY from simulation field
+inline byte sampleEnergy(const byte *aField, int aX, int aY)
+{
+  if (simScale>1) {
+    // supersampled: box filter (average of all cells covered by the LED)
+    const byte *p = &aField[aY*simScale*simPerLevel + aX*simScale];
+    uint32_t sum = 0;
+    for (int dy=0; dy<simScale; dy++) {
+      for (int dx=0; dx<simScale; dx++) sum += p[dx];
+      p += simPerLevel;
+    }
+    return (sum*boxNorm)>>16;
+  }
+  else if (simScale<-1) {
+    // downsampled: bilinear interpolation
+    const byte *r0 = &aField[resampleY0[aY]*simPerLevel];
+    const byte *r1 = &aField[resampleY1[aY]*simPerLevel];
+    uint8_t x0 = resampleX0[aX];
+    uint8_t x1 = resampleX1[aX];
+    uint32_t fx = resampleFX[aX];
+    uint32_t fy = resampleFY[aY];
+    uint32_t e0 = r0[x0]*(256-fx) + r0[x1]*fx;
+    uint32_t e1 = r1[x0]*(256-fx) + r1[x1]*fx;
+    return (e0*(256-fy) + e1*fy)>>16;
+  }
+  // native resolution
+  return aField[aY*simPerLevel+aX];
+}
+
+
+// lowest simulation row sampled for LED row aY
+inline int firstSimRow(int aY)
+{
+  if (simScale>1) return aY*simScale;
+  if (simScale<-1) return resampleY0[aY];
+  return aY;
+}
+
+
+// highest simulation row sampled for LED row aY
+inline int lastSimRow(int aY)
+{
+  if (simScale>1) return aY*simScale+simScale-1;
+  if (simScale<-1) return resampleY1[aY];
+  return aY;
+}
+
+
+// calculate LED colors from energy field
+// @param aPhase 1..256: position between previous (0) and current (256) simulation step
+void calcNextColors(int aPhase)
+{
+  if (!paletteValid) calcPalette();
+  const RGBColor &bg = energyPalette[0];
+  const byte *field = currentEnergy;
+  int fieldRows = track_rows ? activeRows : simLevels;
+  if (aPhase<256) {
+    // interpolate between previous and current step
+    if (track_rows && prevActiveRows>fieldRows) fieldRows = prevActiveRows;
+    // LED rows starting below fieldRows are sampled, and might reach into rows above
+    int sampledRows = fieldRows;
+    for (int y=0; y<levels && firstSimRow(y)<fieldRows; y++) {
+      if (lastSimRow(y)>=sampledRows) sampledRows = lastSimRow(y)+1;
+    }
+    int n = sampledRows*simPerLevel;
+    for (int i=0; i<n; i++) {
+      nextEnergy[i] = prevEnergy[i] + ((((int)currentEnergy[i]-prevEnergy[i])*aPhase)>>8);
+    }
+    field = nextEnergy;
+  }
+  int i = 0;
+  for (int y=0; y<levels; y++) {
+    int ey = upside_down ? levels-1-y : y; // row in energy field
+    // rows above the active simulation rows have no energy
+    bool cold = firstSimRow(ey)>=fieldRows;
+    for (int x=0; x<ledsPerLevel; x++, i++) {
+      if (textLayer[i]>0) {
+        // overlay with text color
+        leds.setColorDimmed(i, red_text, green_text, blue_text, (brightness*textLayer[i])>>8);
+      }
+      else if (cold) {
+        // just background
+        leds.setColor(i, bg.r, bg.g, bg.b);
+      }
       else {
-        if (e>0) {
-          // energy to brightness is non-linear
-          byte eb = energymap[e>>3];
-          byte r = red_bias;
-          byte g = green_bias;
-          byte b = blue_bias;
-          increase(r, (eb*red_energy)>>8);
-          increase(g, (eb*green_energy)>>8);
-          increase(b, (eb*blue_energy)>>8);
-          leds.setColorDimmed(i, r, g, b, brightness);
-        }
-        else {
-          // background, no energy
-          leds.setColorDimmed(i, red_bg, green_bg, blue_bg, brightness);
+        byte e = sampleEnergy(field, upside_down ? ledsPerLevel-1-x : x, ey);
+        const RGBColor &c = energyPalette[paletteIndex(e)];
+        leds.setColor(i, c.r, c.g, c.b);
+      }
+    }
+  }
+}
+
+
+// calculate next frame of the torch animation
+void torchFrame()
+{
+  if (simPhase==0) {
+    // time for next simulation step
+    memcpy(prevEnergy, currentEnergy, simCells);
+    prevActiveRows = activeRows;
+    injectRandom();
+    calcNextEnergy();
+  }
+  simPhase++;
+  calcNextColors(simPhase*256/simDiv);
+  if (simPhase>=simDiv) simPhase = 0;
+}
+
+
+// Adaptive quality control
+// ------------------------
+
+// When frame_budget is set and frames repeatedly take longer, quality is reduced step by step:
+// first the simulation divider is increased up to maxQualityDiv, then simulation resolution is reduced.
+// Quality is increased again one step at a time when there was enough headroom for a while.
+const int maxQualityDiv = 4;
+const int qualityDownFrames = 5; // consecutive overruns needed to reduce quality
+const int qualityUpFrames = 200; // initial number of frames with at least 25% headroom needed to increase quality again
+const int maxQualityUpFrames = 6400; // max for the above, doubled every time an increase needed to be undone
+
+int qualityDrop = 0; // number of quality steps currently dropped
+uint8_t qualityOverruns = 0; // consecutive overruns
+uint16_t qualityHeadroomFrames = 0; // consecutive frames with headroom
+uint16_t qualityUpWait = qualityUpFrames; // frames with headroom needed for next increase
+bool qualityLastWasUp = false; // set when last change was an increase which has not yet proven to hold
+uint16_t qualityStableFrames = 0; // frames since last change
+
+// log of the recent decisions for the "stats" cloud variable
+const int qualityLogSize = 4;
+struct {
+  uint32_t seconds; // time of decision
+  int8_t drop; // qualityDrop set
+} qualityLog[qualityLogSize];
+int qualityLogNext = 0;
+uint16_t qualityDecisions = 0; // total number of decisions
+
+
+// get simulation settings for given number of dropped quality steps
+// @return false if aDrop is more than can be dropped
+bool qualitySettings(int aDrop, int &aDiv, int &aScale)
+{
+  aDiv = sim_div;
+  aScale = validSimScale(sim_scale);
+  while (aDrop>0 && aDiv<maxQualityDiv) { aDiv++; aDrop--; }
+  while (aDrop>0 && aScale>minSimScale) {
+    aScale = aScale==1 ? -2 : aScale-1;
+    aDrop--;
+  }
+  return aDrop==0;
+}
+
+
+// apply sim_scale and sim_div, with current quality drop
+void applyQuality()
+{
+  int div, scale;
+  if (!qualitySettings(qualityDrop, div, scale)) {
+    // settings have changed, current drop too big
+    qualityDrop = 0;
+    qualitySettings(qualityDrop, div, scale);
+  }
+  simDiv = div;
+  if (simPhase>=simDiv) simPhase = 0;
+  if (scale!=simScale) setSimResolution(scale);
+}
+
+
+void changeQuality(int aDrop)
+{
+  qualityDrop = aDrop;
+  applyQuality();
+  qualityLog[qualityLogNext].seconds = millis()/1000;
+  qualityLog[qualityLogNext].drop = qualityDrop;
+  qualityLogNext = (qualityLogNext+1) % qualityLogSize;
+  qualityDecisions++;
+  qualityOverruns = 0;
+  qualityHeadroomFrames = 0;
+  qualityStableFrames = 0;
+}
+
+
+// called once per torch frame with the time it took (calculation and transmission)
+void controlQuality(uint32_t aFrameUs)
+{
+  if (frame_budget==0) {
+    if (qualityDrop>0) changeQuality(0); // back to full quality
+    return;
+  }
+  if (qualityStableFrames<0xFFFF) qualityStableFrames++;
+  if (qualityLastWasUp && qualityStableFrames>=qualityUpFrames) {
+    // last increase has held long enough, later overruns are not its fault
+    qualityLastWasUp = false;
+  }
+  if (aFrameUs>frame_budget) {
+    qualityHeadroomFrames = 0;
+    if (++qualityOverruns>=qualityDownFrames) {
+      int div, scale;
+      if (qualitySettings(qualityDrop+1, div, scale)) {
+        if (qualityLastWasUp) {
+          // previous increase was too much, wait longer before trying again
+          qualityUpWait = qualityUpWait*2>maxQualityUpFrames ? maxQualityUpFrames : qualityUpWait*2;
         }
+        qualityLastWasUp = false;
+        changeQuality(qualityDrop+1);
+      }
+      qualityOverruns = 0;
+    }
+  }
+  else {
+    qualityOverruns = 0;
+    if (qualityDrop>0 && aFrameUs<frame_budget-frame_budget/4) {
+      if (++qualityHeadroomFrames>=qualityUpWait) {
+        qualityLastWasUp = true;
+        changeQuality(qualityDrop-1);
       }
     }
+    else {
+      qualityHeadroomFrames = 0;
+    }
   }
 }
 
 
 void injectRandom()
 {
-  // random flame energy at bottom row
-  for (int i=0; i<ledsPerLevel; i++) {
+  // random flame energy at bottom row (of LEDs)
+  int flameCells = injectRows*simPerLevel;
+  for (int i=0; i<flameCells; i++) {
     currentEnergy[i] = random(flame_min, flame_max);
     energyMode[i] = torch_nop;
   }
-  // random sparks at second row
-  for (int i=ledsPerLevel; i<2*ledsPerLevel; i++) {
+  // random sparks at next simulation row
+  for (int i=flameCells; i<flameCells+simPerLevel; i++) {
     if (energyMode[i]!=torch_spark && random(100)<random_spark_probability) {
       currentEnergy[i] = random(spark_min, spark_max);
       energyMode[i] = torch_spark;
@@ -1257,6 +2958,7 @@ void processCheerColor(String colorName)
 void updateBackgroundWithCheerColor()
 {
   if (cheer_bright>0) {
+    paletteValid = false;
     red_bg = ((int)cheer_red*cheer_bright)>>8;
     green_bg = ((int)cheer_green*cheer_bright)>>8;
     blue_bg = ((int)cheer_blue*cheer_bright)>>8;
@@ -1316,36 +3018,535 @@ void checkCheerlights()
 #endif
 
 
+// Timing instrumentation
+// ======================
+
+// measured values, published as cloud variable "stats" once per second
+uint32_t stat_frame_us = 0; // time needed to calculate last frame (not including transmission to LEDs)
+uint32_t stat_show_us = 0; // time needed to transmit last frame to the LEDs
+uint32_t stat_sim_us = 0; // time needed for torch simulation and color calculation in last frame
+uint16_t stat_frames = 0; // number of frames sent in current statistics interval
+uint32_t stat_idle_us = 0; // time spent sleeping in current statistics interval
+uint32_t stat_interval_start = 0; // start of current statistics interval (micros())
+int stat_cpu_load = 0; // percentage of time NOT spent sleeping in last statistics interval
+uint32_t stat_ttff_ms = 0; // time from power-on to first frame sent to the LEDs
+bool stat_first_frame = true; // set until first frame is sent
+uint32_t stat_last_show_ms = 0; // time when the last frame was sent
+uint32_t stat_gap_ms = 0; // longest time between two frames in current statistics interval
+uint32_t stat_max_gap_ms = 0; // longest time between two frames in last statistics interval
+
+// With RENDER_THREAD, stats are collected by the render thread, but the "stats" cloud variable
+// is read by the system thread, which must never see a half written text. So the render thread
+// writes into statsWork, and the application thread copies it to statsText in publishStats().
+char statsText[500]; // textual representation for the cloud
+char statsWork[500]; // statsText being assembled by updateStats()
+int statsLen = 0;
+volatile bool statsReady = false; // set when statsWork is complete, reset when copied to statsText
+char benchText[160]; // results of last benchmark, included in statsText
+
+
+// append to statsWork, silently truncating when full
+void statsAppend(const char *aFmt, ...)
+{
+  if (statsLen>=(int)sizeof(statsWork)-1) return;
+  va_list args;
+  va_start(args, aFmt);
+  statsLen += vsnprintf(statsWork+statsLen, sizeof(statsWork)-statsLen, aFmt, args);
+  va_end(args);
+}
+
+
+// called from the application thread: make the last complete stats visible to the cloud
+void publishStats()
+{
+  if (statsReady) {
+    __sync_synchronize();
+    memcpy(statsText, statsWork, sizeof(statsText));
+    __sync_synchronize();
+    statsReady = false;
+  }
+}
+
+
+void updateStats()
+{
+  uint32_t now = micros();
+  uint32_t elapsed = now-stat_interval_start;
+  if (elapsed>=1000000) {
+    stat_cpu_load = 100-(int)(((uint64_t)stat_idle_us*100)/elapsed);
+    stat_max_gap_ms = stat_gap_ms;
+    // new text only when the previous one has been published (application thread might be blocked)
+    if (!statsReady) {
+      statsLen = 0;
+      statsAppend(
+        "fps=%u,frame_us=%u,show_us=%u,load=%d,sim_us=%u,rows=%u/%u,spi_ns=%u/%u",
+        (unsigned)stat_frames, (unsigned)stat_frame_us, (unsigned)stat_show_us, stat_cpu_load,
+        (unsigned)stat_sim_us, (unsigned)activeRows, (unsigned)simLevels,
+        (unsigned)leds.getSpiBitNs(), (unsigned)leds.getSpiBitsPerBit()
+      );
+      statsAppend(",irq_off_us=%u,long_gaps=%u,reset_gaps=%u,ttff_ms=%u,gap_ms=%u",
+        (unsigned)leds.getIrqOffMaxUs(), (unsigned)leds.getLongGaps(), (unsigned)leds.getResetGaps(),
+        (unsigned)stat_ttff_ms, (unsigned)stat_max_gap_ms
+      );
+      if (frame_budget>0) {
+        // adaptive quality: current drop and log of recent decisions (drop@seconds since startup)
+        statsAppend(",qdrop=%d,div=%d,scale=%d,qchanges=%u,qlog=", qualityDrop, simDiv, simScale, (unsigned)qualityDecisions);
+        int logged = qualityDecisions<qualityLogSize ? qualityDecisions : qualityLogSize;
+        for (int l=logged; l>0; l--) {
+          int li = (qualityLogNext+qualityLogSize-l) % qualityLogSize;
+          statsAppend("%d@%u;", qualityLog[li].drop, (unsigned)qualityLog[li].seconds);
+        }
+      }
+      if (benchText[0]) {
+        // results of last benchmark
+        statsAppend(",%s", benchText);
+      }
+      #if SELFTEST
+      statsAppend(",selftest_err=%u", (unsigned)selftestErrors);
+      #endif
+      __sync_synchronize(); // text must be complete before application thread sees statsReady
+      statsReady = true;
+    }
+    stat_frames = 0;
+    stat_idle_us = 0;
+    stat_gap_ms = 0;
+    stat_interval_start = now;
+  }
+}
+
+
+// run torch simulation for aCycles frames for every possible sim_scale, and
+// show average time per frame in the "stats" cloud variable
+
+void runBenchmark(int aCycles)
+{
+  if (aCycles<1) aCycles = 1;
+  int savedScale = simScale;
+  int n = snprintf(benchText, sizeof(benchText), "bench_sim_us=");
+  for (int scale=-3; scale<=maxSimScale; scale++) {
+    if (scale==0 || scale==-1) continue;
+    setSimResolution(scale);
+    uint32_t start = micros();
+    for (int c=0; c<aCycles; c++) {
+      injectRandom();
+      calcNextEnergy();
+      calcNextColors(256);
+    }
+    uint32_t t = (micros()-start)/aCycles;
+    if (n<(int)sizeof(benchText)) n += snprintf(benchText+n, sizeof(benchText)-n, "%s%d:%u", scale==-3 ? "" : ";", scale, (unsigned)t);
+  }
+  setSimResolution(savedScale);
+  // text rendering, bit by bit vs. word-parallel, with a sample text when no message is showing
+  String savedText = text;
+  int32_t savedPos = textPos;
+  if (text.length()==0) text = "MessageTorch";
+  rasterizeText();
+  textPos = 0;
+  uint32_t start = micros();
+  for (int c=0; c<aCycles; c++) {
+    resetText();
+    renderTextBitwise(textLayer);
+  }
+  uint32_t tBits = (micros()-start)/aCycles;
+  start = micros();
+  for (int c=0; c<aCycles; c++) {
+    resetText();
+    renderTextWords(textLayer);
+  }
+  uint32_t tWords = (micros()-start)/aCycles;
+  if (n<(int)sizeof(benchText)) snprintf(benchText+n, sizeof(benchText)-n, ",bench_text_us=bits:%u;words:%u", (unsigned)tBits, (unsigned)tWords);
+  text = savedText;
+  rasterizeText();
+  textPos = savedPos;
+}
+
+
+// run benchmark requested via params, between two frames
+void checkBenchmark()
+{
+  if (benchCycles>0) {
+    runBenchmark(benchCycles);
+    benchCycles = 0;
+  }
+}
+
+
+// sleep CPU until next interrupt (SysTick, at latest after 1mS), account time as idle
+void idleSleep()
+{
+  uint32_t t = micros();
+  #if RENDER_THREAD
+  delay(1); // let the other threads run
+  #else
+  __WFI();
+  #endif
+  stat_idle_us += micros()-t;
+}
+
+
+
+// Persistent settings
+// ===================
+
+const uint16_t settingsMagic = 0x7443; // marks valid settings
+const uint32_t settingsSaveDelayMs = 5000; // settings are saved this long after the last change
+
+// parameters that survive a restart (same names and types as the parameter variables)
+typedef struct {
+  uint16_t magic; // settingsMagic
+  uint16_t size; // sizeof(Settings), changes when fields are added
+  byte mode;
+  int brightness;
+  byte fade_base;
+  uint16_t cycle_wait;
+  byte lamp_red, lamp_green, lamp_blue;
+  int lamp_ct;
+  byte red_text, green_text, blue_text;
+  int text_intensity, text_speed, cycles_per_px, text_repeats, fade_per_repeat, text_base_line;
+  int text_layout, text_scale;
+  byte text_smooth;
+  int clock_interval, clock_zone;
+  int history_idle;
+  byte flame_min, flame_max;
+  byte random_spark_probability, spark_min, spark_max, spark_tfr;
+  uint16_t spark_cap, up_rad, side_rad, diag_rad, heat_cap;
+  int wind, wind_gust, wind_swirl;
+  byte red_bg, green_bg, blue_bg, red_bias, green_bias, blue_bias;
+  int red_energy, green_energy, blue_energy;
+  byte upside_down, track_rows;
+  int sim_scale, sim_div;
+  uint32_t frame_budget;
+} Settings;
+
+static_assert(sizeof(Settings)<=eepromSettingsSize, "Settings do not fit into EEPROM space reserved");
+
+Settings settings;
+bool settingsDirty = false; // set when parameters have changed since last save
+uint32_t settingsChangedMs = 0; // time of last change
+Settings paramsBefore; // parameters before handleParams() changed them
+
+
+// copy between parameter variables and settings
+void copySettings(bool aToParams)
+{
+  #define SETTING(f) if (aToParams) f = settings.f; else settings.f = f;
+  SETTING(mode); SETTING(brightness); SETTING(fade_base); SETTING(cycle_wait);
+  SETTING(lamp_red); SETTING(lamp_green); SETTING(lamp_blue); SETTING(lamp_ct);
+  SETTING(red_text); SETTING(green_text); SETTING(blue_text);
+  SETTING(text_intensity); SETTING(text_speed); SETTING(cycles_per_px); SETTING(text_repeats);
+  SETTING(fade_per_repeat); SETTING(text_base_line); SETTING(text_layout); SETTING(text_scale); SETTING(text_smooth);
+  SETTING(clock_interval); SETTING(clock_zone); SETTING(history_idle);
+  SETTING(flame_min); SETTING(flame_max);
+  SETTING(random_spark_probability); SETTING(spark_min); SETTING(spark_max); SETTING(spark_tfr);
+  SETTING(spark_cap); SETTING(up_rad); SETTING(side_rad); SETTING(diag_rad); SETTING(heat_cap);
+  SETTING(wind); SETTING(wind_gust); SETTING(wind_swirl);
+  SETTING(red_bg); SETTING(green_bg); SETTING(blue_bg);
+  SETTING(red_bias); SETTING(green_bias); SETTING(blue_bias);
+  SETTING(red_energy); SETTING(green_energy); SETTING(blue_energy);
+  SETTING(upside_down); SETTING(track_rows); SETTING(sim_scale); SETTING(sim_div); SETTING(frame_budget);
+  #undef SETTING
+}
+
+
+// save current parameters to EEPROM at aAddr
+void saveSettings(int aAddr)
+{
+  copySettings(false);
+  settings.magic = settingsMagic;
+  settings.size = sizeof(Settings);
+  EEPROM.put(aAddr, settings);
+}
+
+
+// load parameters from EEPROM at aAddr
+// @return false if there are no valid settings at aAddr
+bool loadSettings(int aAddr)
+{
+  EEPROM.get(aAddr, settings);
+  if (settings.magic!=settingsMagic || settings.size!=sizeof(Settings)) return false;
+  copySettings(true);
+  // update everything derived from parameters
+  setRadiationKernel();
+  applyQuality();
+  paletteValid = false;
+  needsRefresh = true;
+  return true;
+}
+
+
+// check if EEPROM is large enough for settings at aAddr
+bool settingsFit(int aAddr)
+{
+  return (int)EEPROM.length()>=aAddr+(int)sizeof(Settings);
+}
+
+
+// Scenes are complete sets of parameters, stored like the startup settings
+
+// store current parameters as scene aScene
+// @return false if there is no such scene
+bool saveScene(int aScene)
+{
+  int addr = eepromScenesAddr+aScene*eepromSettingsSize;
+  if (aScene<0 || aScene>=numScenes || !settingsFit(addr)) return false;
+  saveSettings(addr);
+  return true;
+}
+
+
+// recall scene aScene, fading brightness and lamp color within aMs
+// @return false if there is no such scene, or nothing has been stored for it yet
+bool recallScene(int aScene, uint32_t aMs)
+{
+  int addr = eepromScenesAddr+aScene*eepromSettingsSize;
+  if (aScene<0 || aScene>=numScenes || !settingsFit(addr)) return false;
+  int from[numRamps];
+  for (int i=0; i<numRamps; i++) from[i] = getRampedParam(i);
+  int layout = text_layout, scale = text_scale, smooth = text_smooth;
+  if (!loadSettings(addr)) return false;
+  // ramp from previous to recalled values
+  for (int i=0; i<numRamps; i++) {
+    int to = getRampedParam(i);
+    ramps[i].stepPerMs = 0; // stop ramps still running towards the old scene
+    if (aMs>0) setRampedParam(i, from[i]);
+    rampTo(i, to, aMs);
+  }
+  // prepare everything now, so the next frame does not take longer
+  // Note: only parameters change, a message keeps scrolling from where it is, and the torch
+  //   simulation keeps running (resampled by loadSettings() if the resolution changes)
+  calcPalette();
+  if (text_layout!=layout || text_scale!=scale || text_smooth!=smooth) rasterizeText();
+  settingsChanged(); // new startup state
+  return true;
+}
+
+
+// parameters have changed, save them later (not at every change, to save EEPROM writes)
+void settingsChanged()
+{
+  settingsDirty = true;
+  settingsChangedMs = millis();
+}
+
+
+// remember parameters before changing them, see endParamChanges()
+void beginParamChanges()
+{
+  copySettings(false);
+  paramsBefore = settings;
+}
+
+
+// save parameters later only if they really changed since beginParamChanges()
+// (commands like replay, bench or history_clear, or params not in Settings, must not wear the EEPROM)
+void endParamChanges()
+{
+  copySettings(false);
+  if (memcmp(&paramsBefore, &settings, sizeof(Settings))!=0) settingsChanged();
+}
+
+
+void checkSettingsSave()
+{
+  if (settingsDirty && millis()-settingsChangedMs>settingsSaveDelayMs) {
+    settingsDirty = false;
+    if (settingsFit(eepromSettingsAddr)) {
+      saveSettings(eepromSettingsAddr);
+    }
+  }
+}
+
+
 // Main program
 // ============
 
 // Note: in system mode manual, there is no connectivity, and device must be programmed via USB
 // SYSTEM_MODE(MANUAL);
+#if RENDER_THREAD
+// In semi-automatic mode, setup() runs before the cloud connection is up, so the first frame
+// can be shown right after power-on, and the connection is started at the end of setup()
+SYSTEM_MODE(SEMI_AUTOMATIC);
+// system (cloud) runs in its own thread, and the renderer in another one (renderThread())
+SYSTEM_THREAD(ENABLED);
+#else
+// Single threaded (Spark Core), connecting would block loop() until the connection is up, so the
+// torch would show one frame and then freeze. So the default automatic mode is used, which
+// connects before setup() runs.
+#endif
+
+
+// Cloud requests
+// --------------
+
+// With RENDER_THREAD, cloud functions are called from the application thread, while frames
+// are calculated in the render thread. So cloud requests are not executed directly, but
+// passed via this mailbox (the only state shared by the threads) to the render thread, which
+// executes them at the start of the next frame. The calling thread waits for the result.
+// Cloud functions are called one after another, so the mailbox holds one request only.
+
+enum {
+  request_none,
+  request_params,
+  request_message,
+  request_chunk,
+  request_vdsd
+};
+
+volatile int mailboxRequest = request_none; // set by caller, reset by renderer when done
+String mailboxArg; // argument of the request
+volatile int mailboxResult; // result of the request
+
+
+int executeRequest(int aRequest, String aArg)
+{
+  switch (aRequest) {
+    case request_params: return handleParams(aArg);
+    case request_message: return newMessage(aArg);
+    case request_chunk: return messageChunk(aArg);
+    #if !NO_DIGITALSTROM
+    case request_vdsd: return handleVdsd(aArg);
+    #endif
+  }
+  return -1;
+}
+
+
+int postRequest(int aRequest, String aArg)
+{
+  #if RENDER_THREAD
+  mailboxArg = aArg;
+  __sync_synchronize(); // argument must be complete before renderer sees the request
+  mailboxRequest = aRequest;
+  while (mailboxRequest!=request_none) {
+    delay(1);
+  }
+  __sync_synchronize();
+  return mailboxResult;
+  #else
+  // single threaded, execute right now
+  return executeRequest(aRequest, aArg);
+  #endif
+}
+
+
+// called by the renderer at the start of a frame
+void checkMailbox()
+{
+  #if RENDER_THREAD
+  if (mailboxRequest!=request_none) {
+    __sync_synchronize();
+    mailboxResult = executeRequest(mailboxRequest, mailboxArg);
+    __sync_synchronize();
+    mailboxRequest = request_none;
+  }
+  #endif
+}
+
+
+int cloudParams(String aArgs) { return postRequest(request_params, aArgs); }
+int cloudMessage(String aText) { return postRequest(request_message, aText); }
+int cloudChunk(String aChunk) { return postRequest(request_chunk, aChunk); }
+#if !NO_DIGITALSTROM
+int cloudVdsd(String aCommand) { return postRequest(request_vdsd, aCommand); }
+#endif
+
 
 void setup()
 {
-  resetEnergy();
+  // restore last parameters first, so the first frame already looks as before
+  if (settingsFit(eepromSettingsAddr)) {
+    loadSettings(eepromSettingsAddr);
+  }
+  setRadiationKernel();
+  applyQuality();
   resetText();
+  beginHistory();
   leds.begin();
-  // remote control
-  Spark.function("params", handleParams); // parameters
-  Spark.function("message", newMessage); // text message display
+  // remote control (can be registered before being connected)
+  Spark.function("params", cloudParams); // parameters
+  Spark.function("message", cloudMessage); // text message display
+  Spark.function("chunk", cloudChunk); // long text message display, in multiple parts
   #if !NO_DIGITALSTROM
-  Spark.function("vdsd", handleVdsd); // virtual digitalstrom device interface
+  Spark.function("vdsd", cloudVdsd); // virtual digitalstrom device interface
+  #endif
+  Spark.variable("stats", statsText, STRING); // timing statistics and benchmark results
+  // show first frame now (with RENDER_THREAD, before connecting)
+  renderFrame();
+  #if RENDER_THREAD
+  new Thread("render", renderThread, NULL, OS_THREAD_PRIORITY_DEFAULT, 4096);
+  Spark.connect();
   #endif
 }
 
 
+#if RENDER_THREAD
+
+void renderThread(void *aParam)
+{
+  while (true) {
+    renderFrame();
+    checkBenchmark();
+  }
+}
+
+#endif
 
-byte cnt = 0;
 
 void loop()
 {
+  #if !RENDER_THREAD
+  renderFrame();
+  checkBenchmark();
+  #endif
+  publishStats();
+  #if !NO_DIGITALSTROM
+  // notify state changes (publishing can block, so never in the render thread)
+  checkStatePublish();
+  #endif
+  #if SELFTEST
+  if (stall_ms>0) {
+    // block the application loop like a hanging cloud connection would
+    uint32_t t = millis();
+    while (millis()-t<(uint32_t)stall_ms);
+    stall_ms = 0;
+  }
+  #endif
+  #if RENDER_THREAD
+  // nothing else to do here, leave the CPU to the render thread
+  delay(1);
+  #endif
+}
+
+
+
+// returns true if display does not change over time, so nothing needs to be sent until something
+// changes (which is signalled by needsRefresh)
+bool isStaticDisplay()
+{
+  if (mode==mode_off) return true; // off is static, even if text is pending
+  if (text.length()>0) return false; // scrolling text
+  return mode==mode_lamp || mode==mode_testpattern;
+}
+
+
+
+byte cnt = 0;
+
+void renderFrame()
+{
+  // execute cloud requests
+  checkMailbox();
+  // transitions
+  runRamps();
   #if !NO_CHEERLIGHT
   // check cheerlights
   checkCheerlights();
   updateBackgroundWithCheerColor();
   #endif
+  // show queued or idle rotation messages
+  checkMessageQueue();
+  // save changed parameters
+  checkSettingsSave();
   // check clock display
   if (clock_interval>0) {
     time_t now = Time.now(); // UTC
@@ -1357,17 +3558,26 @@ void loop()
        // seconds of hour evenly dividable by clock_interval -> display time now
        char timeString[30];
        strftime(timeString, 30, clock_fmt, loc);
-       newMessage(timeString);
+       showMessage(timeString, false);
     }
   }
 
+  // nothing to do in static modes unless something has changed
+  if (isStaticDisplay() && !needsRefresh) {
+    // just sleep until next interrupt. Cloud events arriving set needsRefresh
+    idleSleep();
+    stat_last_show_ms = millis(); // no frames expected, not a gap
+    updateStats();
+    return;
+  }
+  needsRefresh = false;
+  uint32_t frameStart = micros();
+  bool torchFrameDone = false;
   // render the text
   renderText();
-  int textStart = text_base_line*ledsPerLevel;
-  int textEnd = textStart+rowsPerGlyph*ledsPerLevel;
   switch (mode) {
     case mode_off: {
-      // off
+      // off: send a single blanking frame, then output stops (isStaticDisplay())
       for(int i=0; i<leds.getNumPixels(); i++) {
         leds.setColor(i, 0, 0, 0);
       }
@@ -1376,8 +3586,8 @@ void loop()
     case mode_lamp: {
       // just single color lamp + text display
       for (int i=0; i<leds.getNumPixels(); i++) {
-        if (i>=textStart && i<textEnd && textLayer[i-textStart]>0) {
-          leds.setColorDimmed(i, red_text, green_text, blue_text, (textLayer[i-textStart]*brightness)>>8);
+        if (textLayer[i]>0) {
+          leds.setColorDimmed(i, red_text, green_text, blue_text, (textLayer[i]*brightness)>>8);
         }
         else {
           leds.setColorDimmed(i, lamp_red, lamp_green, lamp_blue, brightness);
@@ -1387,9 +3597,10 @@ void loop()
     }
     case mode_torch: {
       // torch animation + text display + cheerlight background
-      injectRandom();
-      calcNextEnergy();
-      calcNextColors();
+      uint32_t simStart = micros();
+      torchFrame();
+      stat_sim_us = micros()-simStart;
+      torchFrameDone = true;
       break;
     }
     case mode_colorcycle: {
@@ -1398,8 +3609,8 @@ void loop()
       byte r,g,b;
       for(int i=0; i<leds.getNumPixels(); i++) {
         wheel(((i * 256 / leds.getNumPixels()) + cnt) & 255, r, g, b);
-        if (i>=textStart && i<textEnd && textLayer[i-textStart]>0) {
-          leds.setColorDimmed(i, r, g, b, (textLayer[i-textStart]*brightness)>>8);
+        if (textLayer[i]>0) {
+          leds.setColorDimmed(i, r, g, b, (textLayer[i]*brightness)>>8);
         }
         else {
           leds.setColorDimmed(i, r, g, b, brightness>>1); // only half brightness for full area color
@@ -1419,8 +3630,29 @@ void loop()
       break;
     }
   }
+  stat_frame_us = micros()-frameStart;
   // transmit colors to the leds
+  uint32_t showStart = micros();
   leds.show();
+  stat_show_us = micros()-showStart;
+  uint32_t showMs = millis();
+  if (stat_first_frame) {
+    stat_ttff_ms = showMs;
+    stat_first_frame = false;
+  }
+  else if (showMs-stat_last_show_ms>stat_gap_ms) {
+    stat_gap_ms = showMs-stat_last_show_ms;
+  }
+  stat_last_show_ms = showMs;
+  stat_frames++;
+  if (torchFrameDone) controlQuality(stat_frame_us+stat_show_us);
+  updateStats();
   // wait
+  #if RENDER_THREAD
+  // steady frame rate: only wait for what is left of the frame period
+  uint32_t frameMs = (micros()-frameStart)/1000;
+  delay(frameMs<cycle_wait ? cycle_wait-frameMs : 1); // latch & reset needs 50 microseconds pause, at least.
+  #else
   delay(cycle_wait); // latch & reset needs 50 microseconds pause, at least.
+  #endif
 }
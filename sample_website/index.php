@@ -76,12 +76,14 @@
 
   $msg = '';
 
-  if (isset($_REQUEST['message'])) {
+  // call a cloud function on the torch, returns the function's return value or NULL on failure
+  function callTorch($function, $args) {
+    global $spark_id, $spark_access_token;
     $postfields =
       'access_token=' . $spark_access_token .
-      '&args=' . urlencode($_REQUEST['message']);
+      '&args=' . urlencode($args);
     $ch = curl_init();
-    curl_setopt($ch, CURLOPT_URL, 'https://api.spark.io/v1/devices/' . $spark_id . '/message');
+    curl_setopt($ch, CURLOPT_URL, 'https://api.spark.io/v1/devices/' . $spark_id . '/' . $function);
     curl_setopt($ch, CURLOPT_RETURNTRANSFER, true);
     curl_setopt($ch, CURLOPT_FOLLOWLOCATION, true);
     curl_setopt($ch, CURLOPT_POST, 1);
@@ -89,9 +91,40 @@
     curl_setopt($ch, CURLOPT_SSL_VERIFYPEER, 0);
     $result = curl_exec($ch);
     $answer = json_decode($result, true);
-    if ($answer['return_value']==1) {
+    return isset($answer['return_value']) ? $answer['return_value'] : NULL;
+  }
+
+  // cloud function arguments are limited to 63 chars, so longer messages are sent in chunks
+  // of "id,seq,final,payload" via the "chunk" function
+  $max_args = 63;
+  $chunk_payload = 50;
+
+  if (isset($_REQUEST['message'])) {
+    $message = $_REQUEST['message'];
+    $ok = false;
+    $toolong = false;
+    if (strlen($message)<=$max_args) {
+      $ok = callTorch('message', $message)==1;
+    }
+    else {
+      $id = rand(1,999);
+      $parts = str_split($message, $chunk_payload);
+      foreach ($parts as $seq => $part) {
+        $final = $seq==count($parts)-1 ? 1 : 0;
+        $args = $id . ',' . $seq . ',' . $final . ',' . $part;
+        $ret = callTorch('chunk', $args);
+        if ($ret===NULL) $ret = callTorch('chunk', $args); // retry once, repeating a chunk is ok
+        $ok = $ret>0;
+        $toolong = $ret==-3 || $ret==-4; // too long to be displayed
+        if (!$ok) break;
+      }
+    }
+    if ($ok) {
       $msg = 'delivered!';
     }
+    else if ($toolong) {
+      $msg = 'Error, message too long';
+    }
     else {
       $msg = 'Error, message not delivered (MessageTorch might not be running)';
     }